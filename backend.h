@@ -0,0 +1,394 @@
+/* This code is PUBLIC DOMAIN, and is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND. See the accompanying
+ * LICENSE file.
+ */
+
+#ifndef NWM_BACKEND_H
+#define NWM_BACKEND_H
+
+#include <stdio.h>
+#include <string.h>
+#include <X11/cursorfont.h>
+#include <X11/Xatom.h>
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <X11/extensions/Xinerama.h>
+#include <X11/extensions/Xrandr.h>
+
+/**
+ * The display operations nwm uses.
+ *
+ * NodeWM never talks to Xlib directly; it goes through one of these so the
+ * same code runs against a real X server (XBackend) or the in-memory
+ * simulation in fake_backend.h. The method names follow the Xlib calls they
+ * replace, and the structs passed around (XEvent, XWindowAttributes) are the
+ * Xlib ones, so the event dispatch code is identical for both.
+ */
+class Backend {
+public:
+  virtual ~Backend() {}
+
+  // connection
+  virtual int connectionNumber() = 0;
+  virtual Window rootWindow() = 0;
+  virtual int displayWidth() = 0;
+  virtual int displayHeight() = 0;
+  virtual void sync() = 0;
+  virtual void flush() = 0;
+  // sends a no-op and returns its serial: events the server generated
+  // before it got to the no-op carry a lower serial
+  virtual unsigned long fence() = 0;
+  virtual void grabServer() = 0;
+  virtual void ungrabServer() = 0;
+
+  // monitors. screenChangeEvent selects screen change notification on the
+  // root and returns its event type, -1 if the server cannot tell us;
+  // screenChanged must see each such event before displayWidth and
+  // queryScreens are asked again
+  virtual int screenChangeEvent() = 0;
+  virtual void screenChanged(XEvent *ev) = 0;
+  virtual int queryScreens(XRectangle *heads, int max) = 0;
+
+  // event source
+  virtual int pending() = 0;
+  // events already read from the connection, without any I/O
+  virtual int queued() = 0;
+  virtual void nextEvent(XEvent *ev) = 0;
+  virtual void maskEvent(long mask, XEvent *ev) = 0;
+
+  // window tree and attributes; free the children list with freeList()
+  virtual Status queryTree(Window win, Window **children, unsigned int *num) = 0;
+  virtual Status getWindowAttributes(Window win, XWindowAttributes *wa) = 0;
+  virtual Status getTransientForHint(Window win, Window *prop) = 0;
+  virtual Status getWMProtocols(Window win, Atom **protocols, int *num) = 0;
+  // WM_NAME, truncated to size; False if the window has none
+  virtual Bool fetchName(Window win, char *name, int size) = 0;
+  // the class part of WM_CLASS, e.g. XTerm; False if the window has none
+  virtual Bool fetchClass(Window win, char *wm_class, int size) = 0;
+  // _NET_WM_PID and _NET_STARTUP_ID, to tell which spawn() a window is from
+  virtual long getWindowPid(Window win) = 0;
+  virtual Bool getStartupId(Window win, char *id, int size) = 0;
+  virtual void freeList(void *list) = 0;
+  virtual Atom internAtom(const char *name) = 0;
+
+  // configure and map
+  virtual void selectInput(Window win, long mask) = 0;
+  virtual void moveWindow(Window win, int x, int y) = 0;
+  virtual void resizeWindow(Window win, unsigned int width, unsigned int height) = 0;
+  virtual void moveResizeWindow(Window win, int x, int y, unsigned int width, unsigned int height) = 0;
+  virtual void mapWindow(Window win) = 0;
+  // to the top of the stack
+  virtual void raiseWindow(Window win) = 0;
+  // windows[0] stays put, each following one goes directly below the
+  // previous; one ConfigureWindow request per window after the first
+  virtual void restackWindows(Window *windows, int num) = 0;
+  virtual void sendEvent(Window win, long mask, XEvent *ev) = 0;
+
+  // focus
+  virtual void setInputFocus(Window win) = 0;
+
+  // grabs
+  virtual void grabButton(unsigned int button, unsigned int mod, Window win) = 0;
+  virtual void ungrabButton(Window win) = 0;
+  virtual void grabKey(KeySym keysym, unsigned int mod, Window win) = 0;
+  virtual void ungrabKeys(Window win) = 0;
+  virtual KeySym keycodeToKeysym(KeyCode keycode) = 0;
+  virtual Bool grabPointer(Window win, long mask) = 0;
+  virtual void ungrabPointer() = 0;
+  virtual Bool queryPointer(Window win, int *x, int *y) = 0;
+
+  // our own windows and drawing, for the bar; one font, one GC
+  virtual Window createWindow(int x, int y, unsigned int width, unsigned int height,
+                              unsigned long background, long mask) = 0;
+  virtual void destroyWindow(Window win) = 0;
+  virtual Pixmap createPixmap(unsigned int width, unsigned int height) = 0;
+  virtual void freePixmap(Pixmap pixmap) = 0;
+  virtual unsigned long allocColor(const char *name) = 0;
+  virtual Bool loadFont(const char *name, int *ascent, int *descent) = 0;
+  virtual int textWidth(const char *text, int len) = 0;
+  virtual void fillRectangle(Drawable d, unsigned long pixel, int x, int y,
+                             unsigned int width, unsigned int height) = 0;
+  virtual void drawString(Drawable d, unsigned long pixel, int x, int y, const char *text, int len) = 0;
+  virtual void copyArea(Drawable src, Drawable dst, int x, int y, unsigned int width, unsigned int height) = 0;
+};
+
+/**
+ * Backend for a real X server, a thin wrapper over Xlib.
+ */
+class XBackend : public Backend {
+private:
+  Display *dpy;
+  int screen;
+  Window root;
+  Cursor move_cursor;
+  // drawing state; the foreground is cached to save a request per draw
+  GC gc;
+  XFontStruct *font;
+  unsigned long gc_fg;
+  // interned on first use
+  Atom net_wm_pid, net_startup_id;
+
+  GC context() {
+    if(!gc)
+      gc = XCreateGC(dpy, root, 0, NULL);
+    return gc;
+  }
+
+  void foreground(unsigned long pixel) {
+    if(gc_fg != pixel) {
+      XSetForeground(dpy, context(), pixel);
+      gc_fg = pixel;
+    }
+  }
+
+public:
+  /**
+   * Returns NULL if the display cannot be opened.
+   */
+  static XBackend* open(const char *display_name, XErrorHandler handler) {
+    Display *dpy;
+    if((dpy = XOpenDisplay(display_name)) == NULL) {
+      return NULL;
+    }
+    XSetErrorHandler(handler);
+    XSync(dpy, False);
+    return new XBackend(dpy);
+  }
+
+  XBackend(Display *display) :
+    dpy(display),
+    screen(DefaultScreen(display)),
+    root(RootWindow(display, DefaultScreen(display))),
+    move_cursor(None),
+    gc(NULL),
+    font(NULL),
+    gc_fg(~0UL),
+    net_wm_pid(None),
+    net_startup_id(None)
+  {
+  }
+
+  ~XBackend() {
+    if(move_cursor != None)
+      XFreeCursor(dpy, move_cursor);
+    if(font)
+      XFreeFont(dpy, font);
+    if(gc)
+      XFreeGC(dpy, gc);
+    XCloseDisplay(dpy);
+  }
+
+  Display* display() { return dpy; }
+
+  int connectionNumber() { return XConnectionNumber(dpy); }
+  Window rootWindow() { return root; }
+  int displayWidth() { return DisplayWidth(dpy, screen); }
+  int displayHeight() { return DisplayHeight(dpy, screen); }
+  void sync() { XSync(dpy, False); }
+  void flush() { XFlush(dpy); }
+  unsigned long fence() {
+    unsigned long serial = NextRequest(dpy);
+    XNoOp(dpy);
+    return serial;
+  }
+  void grabServer() { XGrabServer(dpy); }
+  void ungrabServer() { XUngrabServer(dpy); }
+
+  int screenChangeEvent() {
+    int event_base, error_base;
+    if(!XRRQueryExtension(dpy, &event_base, &error_base))
+      return -1;
+    XRRSelectInput(dpy, root, RRScreenChangeNotifyMask);
+    return event_base + RRScreenChangeNotify;
+  }
+  void screenChanged(XEvent *ev) { XRRUpdateConfiguration(ev); }
+  // Xinerama heads; RandR keeps them current
+  int queryScreens(XRectangle *heads, int max) {
+    XineramaScreenInfo *info;
+    int i, n = 0;
+    if(!XineramaIsActive(dpy) || !(info = XineramaQueryScreens(dpy, &n)) || n < 1) {
+      heads[0].x = heads[0].y = 0;
+      heads[0].width = DisplayWidth(dpy, screen);
+      heads[0].height = DisplayHeight(dpy, screen);
+      return 1;
+    }
+    for(i = 0; i < n && i < max; i++) {
+      heads[i].x = info[i].x_org;
+      heads[i].y = info[i].y_org;
+      heads[i].width = info[i].width;
+      heads[i].height = info[i].height;
+    }
+    XFree(info);
+    return i;
+  }
+
+  int pending() { return XPending(dpy); }
+  int queued() { return XEventsQueued(dpy, QueuedAlready); }
+  void nextEvent(XEvent *ev) { XNextEvent(dpy, ev); }
+  void maskEvent(long mask, XEvent *ev) { XMaskEvent(dpy, mask, ev); }
+
+  Status queryTree(Window win, Window **children, unsigned int *num) {
+    Window d1, d2;
+    return XQueryTree(dpy, win, &d1, &d2, children, num);
+  }
+  Status getWindowAttributes(Window win, XWindowAttributes *wa) {
+    return XGetWindowAttributes(dpy, win, wa);
+  }
+  Status getTransientForHint(Window win, Window *prop) {
+    return XGetTransientForHint(dpy, win, prop);
+  }
+  Status getWMProtocols(Window win, Atom **protocols, int *num) {
+    return XGetWMProtocols(dpy, win, protocols, num);
+  }
+  Bool fetchName(Window win, char *name, int size) {
+    char *str = NULL;
+    if(!XFetchName(dpy, win, &str) || !str)
+      return False;
+    strncpy(name, str, size - 1);
+    name[size - 1] = '\0';
+    XFree(str);
+    return True;
+  }
+  Bool fetchClass(Window win, char *wm_class, int size) {
+    XClassHint ch = { NULL, NULL };
+    Bool found = False;
+    if(XGetClassHint(dpy, win, &ch) && ch.res_class) {
+      strncpy(wm_class, ch.res_class, size - 1);
+      wm_class[size - 1] = '\0';
+      found = True;
+    }
+    if(ch.res_class)
+      XFree(ch.res_class);
+    if(ch.res_name)
+      XFree(ch.res_name);
+    return found;
+  }
+  long getWindowPid(Window win) {
+    Atom type;
+    int format;
+    unsigned long n, after;
+    unsigned char *data = NULL;
+    long pid = 0;
+    if(!net_wm_pid)
+      net_wm_pid = XInternAtom(dpy, "_NET_WM_PID", False);
+    if(XGetWindowProperty(dpy, win, net_wm_pid, 0, 1, False, XA_CARDINAL,
+                          &type, &format, &n, &after, &data) == Success && data) {
+      if(type == XA_CARDINAL && format == 32 && n == 1)
+        pid = *(long *)data;
+      XFree(data);
+    }
+    return pid;
+  }
+  Bool getStartupId(Window win, char *id, int size) {
+    XTextProperty prop;
+    Bool found = False;
+    if(!net_startup_id)
+      net_startup_id = XInternAtom(dpy, "_NET_STARTUP_ID", False);
+    if(!XGetTextProperty(dpy, win, &prop, net_startup_id) || !prop.value)
+      return False;
+    if(prop.nitems > 0) {
+      strncpy(id, (char *)prop.value, size - 1);
+      id[size - 1] = '\0';
+      found = True;
+    }
+    XFree(prop.value);
+    return found;
+  }
+  void freeList(void *list) { XFree(list); }
+  Atom internAtom(const char *name) { return XInternAtom(dpy, name, False); }
+
+  void selectInput(Window win, long mask) { XSelectInput(dpy, win, mask); }
+  void moveWindow(Window win, int x, int y) { XMoveWindow(dpy, win, x, y); }
+  void resizeWindow(Window win, unsigned int width, unsigned int height) {
+    XResizeWindow(dpy, win, width, height);
+  }
+  void moveResizeWindow(Window win, int x, int y, unsigned int width, unsigned int height) {
+    XMoveResizeWindow(dpy, win, x, y, width, height);
+  }
+  void mapWindow(Window win) { XMapWindow(dpy, win); }
+  void raiseWindow(Window win) { XRaiseWindow(dpy, win); }
+  void restackWindows(Window *windows, int num) { XRestackWindows(dpy, windows, num); }
+  void sendEvent(Window win, long mask, XEvent *ev) {
+    XSendEvent(dpy, win, False, mask, ev);
+  }
+
+  void setInputFocus(Window win) {
+    XSetInputFocus(dpy, win, RevertToPointerRoot, CurrentTime);
+  }
+
+  void grabButton(unsigned int button, unsigned int mod, Window win) {
+    XGrabButton(dpy, button, mod, win, False, (ButtonPressMask|ButtonReleaseMask),
+                GrabModeAsync, GrabModeSync, None, None);
+  }
+  void ungrabButton(Window win) { XUngrabButton(dpy, AnyButton, AnyModifier, win); }
+  void grabKey(KeySym keysym, unsigned int mod, Window win) {
+    XGrabKey(dpy, XKeysymToKeycode(dpy, keysym), mod, win, True, GrabModeAsync, GrabModeAsync);
+  }
+  void ungrabKeys(Window win) { XUngrabKey(dpy, AnyKey, AnyModifier, win); }
+  KeySym keycodeToKeysym(KeyCode keycode) { return XKeycodeToKeysym(dpy, keycode, 0); }
+  Bool grabPointer(Window win, long mask) {
+    if(move_cursor == None)
+      move_cursor = XCreateFontCursor(dpy, XC_fleur);
+    return XGrabPointer(dpy, win, False, mask, GrabModeAsync, GrabModeAsync,
+                        None, move_cursor, CurrentTime) == GrabSuccess;
+  }
+  void ungrabPointer() { XUngrabPointer(dpy, CurrentTime); }
+  Bool queryPointer(Window win, int *x, int *y) {
+    int di;
+    unsigned int dui;
+    Window dummy;
+    return XQueryPointer(dpy, win, &dummy, &dummy, x, y, &di, &di, &dui);
+  }
+
+  Window createWindow(int x, int y, unsigned int width, unsigned int height,
+                      unsigned long background, long mask) {
+    XSetWindowAttributes wa;
+    wa.override_redirect = True;
+    wa.background_pixel = background;
+    wa.event_mask = mask;
+    return XCreateWindow(dpy, root, x, y, width, height, 0, DefaultDepth(dpy, screen),
+                         CopyFromParent, DefaultVisual(dpy, screen),
+                         CWOverrideRedirect|CWBackPixel|CWEventMask, &wa);
+  }
+  void destroyWindow(Window win) { XDestroyWindow(dpy, win); }
+  Pixmap createPixmap(unsigned int width, unsigned int height) {
+    return XCreatePixmap(dpy, root, width, height, DefaultDepth(dpy, screen));
+  }
+  void freePixmap(Pixmap pixmap) { XFreePixmap(dpy, pixmap); }
+  unsigned long allocColor(const char *name) {
+    XColor color;
+    if(!XAllocNamedColor(dpy, DefaultColormap(dpy, screen), name, &color, &color)) {
+      fprintf(stderr, "cannot allocate color %s\n", name);
+      return BlackPixel(dpy, screen);
+    }
+    return color.pixel;
+  }
+  Bool loadFont(const char *name, int *ascent, int *descent) {
+    XFontStruct *f;
+    if(!(f = XLoadQueryFont(dpy, name)) && !(f = XLoadQueryFont(dpy, "fixed")))
+      return False;
+    if(font)
+      XFreeFont(dpy, font);
+    font = f;
+    XSetFont(dpy, context(), font->fid);
+    *ascent = font->ascent;
+    *descent = font->descent;
+    return True;
+  }
+  // computed from the font metrics on our side, no request
+  int textWidth(const char *text, int len) { return XTextWidth(font, text, len); }
+  void fillRectangle(Drawable d, unsigned long pixel, int x, int y,
+                     unsigned int width, unsigned int height) {
+    foreground(pixel);
+    XFillRectangle(dpy, d, gc, x, y, width, height);
+  }
+  void drawString(Drawable d, unsigned long pixel, int x, int y, const char *text, int len) {
+    foreground(pixel);
+    XDrawString(dpy, d, gc, x, y, text, len);
+  }
+  void copyArea(Drawable src, Drawable dst, int x, int y, unsigned int width, unsigned int height) {
+    XCopyArea(dpy, src, dst, context(), x, y, width, height, x, y);
+  }
+};
+
+#endif
@@ -0,0 +1,173 @@
+/* This code is PUBLIC DOMAIN, and is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND. See the accompanying
+ * LICENSE file.
+ */
+
+#ifndef NWM_BAR_H
+#define NWM_BAR_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "backend.h"
+
+/**
+ * The status bar: workspaces on the left, the focused window's title in the
+ * middle, status text on the right.
+ *
+ * Each segment caches its text and text width. Changing a segment only marks
+ * it dirty (or nothing, if the text is the same); bar_draw repaints the dirty
+ * segments into the pixmap and copies just those rectangles to the window.
+ * A segment whose text width changes moves the title boundary, so the title
+ * is repainted too, but never the whole bar. Expose only copies the pixmap.
+ */
+
+#define BAR_TEXT 256
+
+enum {
+  BarWorkspaces,
+  BarTitle,
+  BarStatus,
+  BarSegments
+};
+
+typedef struct {
+  char text[BAR_TEXT];
+  int len;
+  int textw;           // cached width of text
+  int x, w;            // where the segment is on the bar
+  Bool selected;       // drawn in the selected colors
+  Bool dirty;
+} BarSegment;
+
+typedef struct {
+  Window win;
+  Pixmap buf;
+  int x, y, w, h;
+  int ascent;
+  int pad;             // left + right padding of each segment
+  unsigned long norm_fg, norm_bg, sel_fg, sel_bg;
+  BarSegment seg[BarSegments];
+  Bool layout_dirty;
+} Bar;
+
+/**
+ * Create a bar along the bottom of the area x, y, w, h.
+ * Returns NULL if the font cannot be loaded.
+ */
+static Bar* bar_create(Backend *be, int x, int y, int w, int h, const char *font) {
+  Bar *bar;
+  int ascent, descent;
+  if(!be->loadFont(font, &ascent, &descent)) {
+    fprintf(stderr, "cannot load font %s\n", font);
+    return NULL;
+  }
+  if(!(bar = (Bar *)calloc(1, sizeof(Bar)))) {
+    fprintf( stderr, "fatal: could not malloc() %lu bytes\n", sizeof(Bar));
+    exit( -1 );
+  }
+  bar->h = ascent + descent + 2;
+  bar->x = x;
+  bar->y = y + h - bar->h;
+  bar->w = w;
+  bar->ascent = ascent;
+  bar->pad = ascent + descent;
+  bar->norm_fg = be->allocColor("#bbbbbb");
+  bar->norm_bg = be->allocColor("#222222");
+  bar->sel_fg = be->allocColor("#eeeeee");
+  bar->sel_bg = be->allocColor("#005577");
+  bar->win = be->createWindow(bar->x, bar->y, bar->w, bar->h, bar->norm_bg, ExposureMask);
+  bar->buf = be->createPixmap(bar->w, bar->h);
+  bar->layout_dirty = True;
+  be->mapWindow(bar->win);
+  return bar;
+}
+
+static void bar_destroy(Bar *bar, Backend *be) {
+  be->freePixmap(bar->buf);
+  be->destroyWindow(bar->win);
+  free(bar);
+}
+
+/**
+ * Set a segment's text. Costs a strcmp if nothing changed.
+ */
+static void bar_set_text(Bar *bar, Backend *be, int i, const char *text, Bool selected) {
+  BarSegment *s = &bar->seg[i];
+  if(s->selected == selected && strncmp(s->text, text, BAR_TEXT - 1) == 0)
+    return;
+  strncpy(s->text, text, BAR_TEXT - 1);
+  s->text[BAR_TEXT - 1] = '\0';
+  s->len = strlen(s->text);
+  s->selected = selected;
+  s->dirty = True;
+  int textw = (s->len ? be->textWidth(s->text, s->len) : 0);
+  if(textw != s->textw && i != BarTitle)
+    bar->layout_dirty = True;
+  s->textw = textw;
+}
+
+static void bar_layout(Bar *bar) {
+  BarSegment *ws = &bar->seg[BarWorkspaces];
+  BarSegment *title = &bar->seg[BarTitle];
+  BarSegment *status = &bar->seg[BarStatus];
+  int x, w;
+
+  w = (ws->len ? ws->textw + bar->pad : 0);
+  if(ws->x != 0 || ws->w != w) {
+    ws->x = 0;
+    ws->w = w;
+    ws->dirty = True;
+  }
+  w = (status->len ? status->textw + bar->pad : 0);
+  if(w > bar->w - ws->w)
+    w = bar->w - ws->w;
+  x = bar->w - w;
+  if(status->x != x || status->w != w) {
+    status->x = x;
+    status->w = w;
+    status->dirty = True;
+  }
+  x = ws->w;
+  w = status->x - ws->w;
+  if(title->x != x || title->w != w) {
+    title->x = x;
+    title->w = w;
+    title->dirty = True;
+  }
+  bar->layout_dirty = False;
+}
+
+/**
+ * Paint the dirty segments. Returns the number of segments painted.
+ */
+static int bar_draw(Bar *bar, Backend *be) {
+  int i, len, painted = 0;
+  if(bar->layout_dirty)
+    bar_layout(bar);
+  for(i = 0; i < BarSegments; i++) {
+    BarSegment *s = &bar->seg[i];
+    if(!s->dirty)
+      continue;
+    s->dirty = False;
+    if(s->w <= 0)
+      continue;
+    be->fillRectangle(bar->buf, (s->selected ? bar->sel_bg : bar->norm_bg), s->x, 0, s->w, bar->h);
+    // when the bar is full a segment is narrower than its text, cut it
+    len = s->len;
+    while(len > 0 && (len < s->len ? be->textWidth(s->text, len) : s->textw) > s->w - bar->pad)
+      len--;
+    if(len > 0)
+      be->drawString(bar->buf, (s->selected ? bar->sel_fg : bar->norm_fg),
+                     s->x + bar->pad / 2, (bar->h - bar->pad) / 2 + bar->ascent, s->text, len);
+    be->copyArea(bar->buf, bar->win, s->x, 0, s->w, bar->h);
+    painted++;
+  }
+  return painted;
+}
+
+static void bar_expose(Bar *bar, Backend *be) {
+  be->copyArea(bar->buf, bar->win, 0, 0, bar->w, bar->h);
+}
+
+#endif
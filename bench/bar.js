@@ -0,0 +1,36 @@
+// Bar redraw cost against the in-memory X server. Each update is followed by
+// dispatch(), which commits and paints only the segments that changed.
+//
+//   node bench/bar.js [updates]
+var X11wm = require('../build/default/nwm.node').NodeWM;
+
+var count = parseInt(process.argv[2], 10) || 10000;
+var wm = new X11wm();
+var screen = wm.setup({ fake: { width: 1280, height: 800 }, bar: true });
+
+wm.on('add', function(window) { wm.focusWindow(window.id); });
+wm.on('remove', function(id) {});
+wm.on('rearrange', function() {});
+
+function time(name, fn) {
+  var before = wm.simStats();
+  var start = Date.now();
+  for(var i = 0; i < count; i++) {
+    fn(i);
+    wm.dispatch();
+  }
+  var ms = Date.now() - start;
+  var after = wm.simStats();
+  console.log(name + ': ' + (ms * 1000 / count).toFixed(2) + 'us/update'
+    + ', ' + ((after.requests - before.requests) / count).toFixed(1) + ' requests/update'
+    + ', ' + Math.round((after.pixels - before.pixels) / count) + ' pixels/update');
+}
+
+var win = wm.simCreateWindow(0, 0, 200, 100);
+wm.simMapWindow(win);
+wm.dispatch();
+
+time('title', function(i) { wm.simSetName(win, 'xterm ' + i); });
+time('status', function(i) { wm.setStatus('load ' + (i % 100)); });
+time('unchanged', function(i) { wm.setStatus('load 99'); });
+time('workspaces', function(i) { wm.setWorkspaces(' 1 [' + (i % 9 + 1) + ']'); });
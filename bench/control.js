@@ -0,0 +1,82 @@
+// Control socket round trips and throughput, against the in-memory X server.
+//
+//   node bench/control.js [commands] [clients]
+var net = require('net');
+var X11wm = require('../build/default/nwm.node').NodeWM;
+
+var count = parseInt(process.argv[2], 10) || 20000;
+var clients = parseInt(process.argv[3], 10) || 8;
+var path = '/tmp/nwm-bench.sock';
+var wm = new X11wm();
+
+wm.on('add', function(window) {});
+wm.on('remove', function(id) {});
+wm.on('rearrange', function() {});
+wm.on('command', function(name, args) { return args.join(' '); });
+wm.setup({ fake: { width: 1280, height: 800 }, control: path });
+for(var i = 0; i < 100; i++) {
+  wm.simMapWindow(wm.simCreateWindow(0, 0, 200, 100));
+}
+wm.dispatch();
+wm.loop();
+
+// calls done(ms) once n replies to line(i) have arrived; pipelined sends
+// everything at once, otherwise each command waits for the previous reply
+function run(n, pipelined, line, done) {
+  var sock = net.createConnection(path);
+  var replies = 0, sent = 0, buf = '', start;
+  function send() {
+    if(pipelined) {
+      var lines = [];
+      for(; sent < n; sent++) lines.push(line(sent));
+      sock.write(lines.join('\n') + '\n');
+    } else {
+      sock.write(line(sent++) + '\n');
+    }
+  }
+  sock.setEncoding('utf8');
+  sock.on('connect', function() { start = Date.now(); send(); });
+  sock.on('data', function(data) {
+    var lines = (buf + data).split('\n');
+    buf = lines.pop();
+    replies += lines.length;
+    if(replies >= n) {
+      sock.end();
+      return done(Date.now() - start);
+    }
+    if(!pipelined) send();
+  });
+}
+
+function report(name, n, ms) {
+  console.log(name + ': ' + n + ' commands in ' + ms + 'ms, '
+    + (ms * 1000 / n).toFixed(1) + 'us/command, '
+    + Math.round(n * 1000 / (ms || 1)) + ' commands/s');
+}
+
+function ping(i) { return 'ping'; }
+function focus(i) { return 'focus ' + (i % 100 + 1); }
+function js(i) { return 'echo ' + i; }
+
+var tests = [
+  function(next) { run(count, false, ping, function(ms) { report('ping, round trip', count, ms); next(); }); },
+  function(next) { run(count, false, js, function(ms) { report('js command, round trip', count, ms); next(); }); },
+  function(next) { run(count, true, focus, function(ms) { report('focus, pipelined', count, ms); next(); }); },
+  function(next) {
+    var left = clients, start = Date.now();
+    for(var i = 0; i < clients; i++) {
+      run(count, true, ping, function() {
+        if(--left == 0) {
+          report('ping, ' + clients + ' clients pipelined', count * clients, Date.now() - start);
+          next();
+        }
+      });
+    }
+  }
+];
+
+(function next() {
+  var test = tests.shift();
+  if(test) return test(next);
+  process.exit(0);
+})();
@@ -0,0 +1,59 @@
+// Microbenchmark against the in-memory X server: no Xvfb needed and the
+// numbers only depend on nwm itself.
+//
+//   node bench/dispatch.js [clients]
+var X11wm = require('../build/default/nwm.node').NodeWM;
+
+var count = parseInt(process.argv[2], 10) || 2000;
+var wm = new X11wm();
+var windows = {};
+var screen = wm.setup({ fake: { width: 1280, height: 800 } });
+
+wm.on('add', function(window) { windows[window.id] = window; });
+wm.on('remove', function(id) { delete windows[id]; });
+wm.on('rearrange', function() {});
+wm.on('enterNotify', function(event) { wm.focusWindow(event.id); });
+
+function time(name, fn) {
+  var before = wm.simStats();
+  var start = Date.now();
+  var events = fn();
+  var ms = Date.now() - start;
+  var after = wm.simStats();
+  console.log(name + ': ' + ms + 'ms, ' + events + ' events'
+    + ', ' + (after.requests - before.requests) + ' requests'
+    + ', ' + (after.roundtrips - before.roundtrips) + ' roundtrips'
+    + ', ' + (after.flushes - before.flushes) + ' flushes');
+}
+
+var wins = [];
+time('manage ' + count, function() {
+  for(var i = 0; i < count; i++) {
+    var win = wm.simCreateWindow(i % screen.width, i % screen.height, 200, 100);
+    wm.simMapWindow(win);
+    wins.push(win);
+  }
+  return wm.dispatch();
+});
+
+time('enter ' + count, function() {
+  wins.forEach(function(win) { wm.simEnterWindow(win); });
+  return wm.dispatch();
+});
+
+time('raise ' + count, function() {
+  Object.keys(windows).forEach(function(id) { wm.raise(id); });
+  return wm.dispatch();
+});
+
+time('move ' + count, function() {
+  Object.keys(windows).forEach(function(id, index) {
+    wm.moveWindow(id, index % screen.width, 0);
+  });
+  return wm.dispatch();
+});
+
+time('destroy ' + count, function() {
+  wins.forEach(function(win) { wm.simDestroyWindow(win); });
+  return wm.dispatch();
+});
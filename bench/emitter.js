@@ -0,0 +1,48 @@
+// Listener filters: events for other windows should never reach JS.
+//
+//   node bench/emitter.js [windows] [rounds]
+var X11wm = require('../build/default/nwm.node').NodeWM;
+
+var count = parseInt(process.argv[2], 10) || 1000;
+var rounds = parseInt(process.argv[3], 10) || 20;
+var wm = new X11wm();
+var wins = [], ids = [];
+
+wm.on('add', function(window) { ids.push(window.id); });
+wm.setup({ fake: { width: 1280, height: 800 } });
+for(var i = 0; i < count; i++) {
+  var win = wm.simCreateWindow(i % 1280, 0, 200, 100);
+  wm.simMapWindow(win);
+  wins.push(win);
+}
+wm.dispatch();
+
+function time(name, add) {
+  var seen = 0;
+  function listener(event) { seen++; }
+  add(listener);
+  var before = wm.stats().enterNotify;
+  var start = Date.now();
+  for(var r = 0; r < rounds; r++) {
+    wins.forEach(function(win) { wm.simEnterWindow(win); });
+    wm.dispatch();
+  }
+  var ms = Date.now() - start;
+  var after = wm.stats().enterNotify;
+  wm.off('enterNotify');
+  console.log(name + ': ' + ms + 'ms for ' + (count * rounds) + ' events'
+    + ', ' + (after.calls - before.calls) + ' listener calls'
+    + ', ' + (after.filtered - before.filtered) + ' filtered natively'
+    + ', ' + seen + ' seen by JS');
+}
+
+var target = ids[0];
+time('filter in JS', function(listener) {
+  wm.on('enterNotify', function(event) { if(event.id == target) listener(event); });
+});
+time('native filter', function(listener) {
+  wm.on('enterNotify', listener, { id: target });
+});
+time('4 listeners, native filters', function(listener) {
+  for(var i = 0; i < 4; i++) wm.on('enterNotify', listener, { id: ids[i] });
+});
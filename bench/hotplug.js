@@ -0,0 +1,46 @@
+// Cost of plugging and unplugging a monitor, against the in-memory X server.
+// Only the clients of the head that goes away should be touched.
+//
+//   node bench/hotplug.js [clients]
+var X11wm = require('../build/default/nwm.node').NodeWM;
+
+var count = parseInt(process.argv[2], 10) || 2000;
+var wm = new X11wm();
+var left = { x: 0, y: 0, width: 1280, height: 800 };
+var right = { x: 1280, y: 0, width: 1920, height: 1080 };
+var last = null;
+
+wm.on('add', function(window) {});
+wm.on('remove', function(id) {});
+wm.on('rearrange', function() {});
+wm.on('screenChange', function(screen) { last = screen; });
+wm.setup({ fake: { width: 1280, height: 800 } });
+wm.simSetScreens([left, right]);
+wm.dispatch();
+
+// most clients on the big monitor
+for(var i = 0; i < count; i++) {
+  var win = (i % 10 == 0 ? wm.simCreateWindow(10, 10, 200, 100) : wm.simCreateWindow(1300, 10, 200, 100));
+  wm.simMapWindow(win);
+}
+wm.dispatch();
+
+function time(name, heads) {
+  var before = wm.simStats();
+  var start = Date.now();
+  wm.simSetScreens(heads);
+  wm.dispatch();
+  var ms = Date.now() - start;
+  var after = wm.simStats();
+  console.log(name + ': ' + ms + 'ms'
+    + ', ' + (after.requests - before.requests) + ' requests'
+    + ', ' + (after.roundtrips - before.roundtrips) + ' roundtrips'
+    + ', ' + (last ? last.moved.length : 0) + ' clients moved'
+    + ', changed monitors ' + (last ? last.monitors.filter(function(m) { return m.changed; }).map(function(m) { return m.id; }) : []));
+  last = null;
+}
+
+time('unplug the small monitor', [right]);
+time('plug it back', [right, left]);
+time('rotate the small monitor', [right, { x: 1920, y: 0, width: 800, height: 1280 }]);
+time('unplug the big monitor', [right]);
@@ -0,0 +1,40 @@
+// Replay an event trace recorded with wm.record() (or NWM_TRACE=file node nwm.js)
+// and report events/sec and per-handler latency.
+//
+//   node bench/replay.js trace.bin            # in-memory X server, as fast as possible
+//   node bench/replay.js trace.bin --paced    # keep the recorded timing
+var X11wm = require('../build/default/nwm.node').NodeWM;
+
+var path = process.argv[2];
+var paced = process.argv.indexOf('--paced') > -1;
+if(!path) {
+  console.log('usage: node bench/replay.js trace.bin [--paced]');
+  process.exit(1);
+}
+
+var wm = new X11wm();
+wm.setup({ fake: { width: 1280, height: 800 } });
+// listeners that do as much work as nwm.js does
+var windows = {};
+wm.on('add', function(window) { windows[window.id] = window; });
+wm.on('remove', function(id) { delete windows[id]; });
+wm.on('rearrange', function() {});
+wm.on('buttonPress', function(event) { wm.focusWindow(event.id); });
+wm.on('enterNotify', function(event) { wm.focusWindow(event.id); });
+wm.on('keyPress', function(key) { return key; });
+
+function print(report) {
+  console.log(report.events + ' events in ' + report.seconds.toFixed(3) + 's, '
+    + Math.round(report.events_per_second) + ' events/sec');
+  Object.keys(report.handlers).forEach(function(name) {
+    var h = report.handlers[name];
+    console.log('  ' + name + ': ' + h.count + ' events, mean ' + h.mean_us.toFixed(1)
+      + 'us, max ' + h.max_us.toFixed(1) + 'us');
+  });
+}
+
+if(paced) {
+  wm.replay(path, { paced: true }, print);
+} else {
+  print(wm.replay(path));
+}
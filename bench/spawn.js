@@ -0,0 +1,120 @@
+// Launching programs: the native spawn() against child_process.spawn.
+//
+//   node bench/spawn.js [count]        in-memory X server: cost of the
+//                                      spawn call, and the X requests it
+//                                      takes to put a window on another
+//                                      workspace
+//   node bench/spawn.js --x [count]    real X server on $DISPLAY (nothing
+//                                      else managing it, xdotool needed):
+//                                      keypress to xterm's window mapped
+var X11wm = require('../build/default/nwm.node').NodeWM;
+var child_process = require('child_process');
+
+var real = (process.argv[2] == '--x');
+var count = parseInt(process.argv[real ? 3 : 2], 10) || (real ? 20 : 500);
+var wm = new X11wm();
+
+function report(name, times) {
+  times.sort(function(a, b) { return a - b; });
+  var sum = times.reduce(function(a, b) { return a + b; }, 0);
+  console.log(name + ': mean ' + (sum / times.length).toFixed(1) + 'ms'
+    + ', median ' + times[Math.floor(times.length / 2)] + 'ms'
+    + ', max ' + times[times.length - 1] + 'ms');
+}
+
+if(!real) {
+  var screen = wm.setup({ fake: { width: 1280, height: 800 } });
+  var windows = {};
+  wm.on('add', function(window) {
+    windows[window.id] = window;
+    // what nwm.js does for a window of another workspace
+    if(window.workspace !== undefined && window.workspace != 1) {
+      wm.moveWindow(window.id, window.x + 2 * screen.width, window.y);
+    }
+  });
+  wm.on('rearrange', function() {
+    Object.keys(windows).forEach(function(id) {
+      if(windows[id].workspace === undefined || windows[id].workspace == 1) {
+        wm.moveWindow(id, 0, 0);
+        wm.resizeWindow(id, screen.width, screen.height);
+      }
+    });
+  });
+
+  // time spent in the call, which is time the keyPress handler blocks;
+  // a single call is below Date.now() resolution, so time them all
+  function calls(name, fn) {
+    var start = Date.now();
+    for(var i = 0; i < count; i++) {
+      fn();
+    }
+    var ms = Date.now() - start;
+    console.log(name + ': ' + ms + 'ms for ' + count + ', ' + (ms * 1000 / count).toFixed(1) + 'us per call');
+  }
+  calls('wm.spawn call', function() { wm.spawn(['true']); });
+  calls('child_process.spawn call', function() { child_process.spawn('true'); });
+
+  // a window for workspace 2: placed at manage time, against being
+  // managed on the current workspace and then moved away
+  function add(pid, workspace) {
+    var win = wm.simCreateWindow(10, 10, 200, 100);
+    if(pid) {
+      wm.simSetPid(win, pid, null);
+    }
+    var before = wm.simStats();
+    wm.simMapWindow(win);
+    wm.dispatch();
+    if(!pid) {
+      var id = Math.max.apply(null, Object.keys(windows));
+      windows[id].workspace = workspace;
+      wm.moveWindow(id, windows[id].x + 2 * screen.width, windows[id].y);
+      wm.dispatch();
+    }
+    var after = wm.simStats();
+    return (after.requests - before.requests) + ' requests, '
+      + (after.roundtrips - before.roundtrips) + ' roundtrips';
+  }
+  var pid = wm.spawn(['sleep', '10'], { workspace: 2 });
+  console.log('spawned window to workspace 2: ' + add(pid, 2));
+  console.log('window moved to workspace 2 after add: ' + add(0, 2));
+  process.kill(pid);
+  process.exit(0);
+}
+
+// real X server: xdotool types F12, the keyPress listener launches xterm
+// one way or the other, and the clock stops when the window is mapped;
+// one xterm at a time. Starting xdotool is in the times of both.
+var F12 = wm.keysymFromName('XK_F12');
+var how = null, pid = 0, start = 0, runs = 0;
+var results = { native: [], node: [] };
+
+wm.on('keyPress', function(key) {
+  if(how == 'native') {
+    pid = wm.spawn(['xterm']);
+  } else {
+    pid = child_process.spawn('xterm', [], { env: process.env }).pid;
+  }
+}, { keysym: 'XK_F12' });
+wm.on('mapNotify', function(event) {
+  if(!how) {
+    return;
+  }
+  results[how].push(Date.now() - start);
+  process.kill(pid);
+  how = null;
+  setTimeout(next, 200);
+});
+wm.setup({ keys: [ { key: F12, modifier: 0 } ] });
+wm.loop();
+
+function next() {
+  if(runs == 2 * count) {
+    report('wm.spawn, keypress to mapped', results.native);
+    report('child_process.spawn, keypress to mapped', results.node);
+    process.exit(0);
+  }
+  how = (runs++ % 2 ? 'node' : 'native');
+  start = Date.now();
+  child_process.spawn('xdotool', ['key', 'F12'], { env: process.env });
+}
+next();
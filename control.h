@@ -0,0 +1,220 @@
+/* This code is PUBLIC DOMAIN, and is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND. See the accompanying
+ * LICENSE file.
+ */
+
+#ifndef NWM_CONTROL_H
+#define NWM_CONTROL_H
+
+#include <ev.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <X11/Xlib.h>
+
+/**
+ * The control socket: a Unix domain stream socket speaking a line protocol.
+ *
+ * Clients send one command per line and may send any number of lines
+ * without waiting; replies come back in the same order. Everything a client
+ * sent in one read is handled in one go, and the replies collected during a
+ * loop iteration are written with one write() per client. This file only
+ * deals with sockets and buffers; the commands live in nwm.cc.
+ */
+
+#define CONTROL_LINE 1024
+// unsent replies and events a client may have before it is dropped
+#define CONTROL_OUT_MAX (256 * 1024)
+
+typedef struct ControlClient ControlClient;
+struct ControlClient {
+  ev_io io;
+  int fd;
+  char in[CONTROL_LINE * 4];
+  int inlen;
+  int inpos;           // start of the next line in `in`
+  char *out;
+  size_t outlen, outcap;
+  unsigned int events; // subscribed events
+  Bool overflow;       // hit CONTROL_OUT_MAX, to be closed
+  ControlClient *next;
+};
+
+static Bool control_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL);
+  return flags != -1 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) != -1
+      && fcntl(fd, F_SETFD, FD_CLOEXEC) != -1;
+}
+
+/**
+ * Returns the listening socket, or -1. A stale socket file is replaced.
+ * Only our user may connect: anyone who can send commands can move,
+ * focus and list windows.
+ */
+static int control_listen(const char *path) {
+  struct sockaddr_un addr;
+  mode_t mask;
+  int fd, bound;
+  if(strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "control socket path too long: %s\n", path);
+    return -1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+  if((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    fprintf(stderr, "control socket: %s\n", strerror(errno));
+    return -1;
+  }
+  unlink(path);
+  // the socket file is created 0600 rather than chmod()ed afterwards
+  mask = umask(077);
+  bound = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if(bound == -1
+  || listen(fd, SOMAXCONN) == -1
+  || !control_nonblock(fd)) {
+    fprintf(stderr, "control socket %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/**
+ * Returns NULL when there is no connection waiting.
+ */
+static ControlClient* control_accept(int lfd) {
+  ControlClient *cl;
+  int fd;
+  if((fd = accept(lfd, NULL, NULL)) == -1)
+    return NULL;
+  if(!control_nonblock(fd)) {
+    close(fd);
+    return NULL;
+  }
+  if(!(cl = (ControlClient *)calloc(1, sizeof(ControlClient)))) {
+    fprintf( stderr, "fatal: could not malloc() %lu bytes\n", sizeof(ControlClient));
+    exit( -1 );
+  }
+  cl->fd = fd;
+  return cl;
+}
+
+static void control_free(ControlClient *cl) {
+  close(cl->fd);
+  free(cl->out);
+  free(cl);
+}
+
+/**
+ * Read what is available. Returns False if the client went away.
+ */
+static Bool control_read(ControlClient *cl) {
+  ssize_t n;
+  // keep the unfinished line, drop the handled ones
+  if(cl->inpos > 0) {
+    memmove(cl->in, cl->in + cl->inpos, cl->inlen - cl->inpos);
+    cl->inlen -= cl->inpos;
+    cl->inpos = 0;
+  }
+  n = read(cl->fd, cl->in + cl->inlen, sizeof(cl->in) - cl->inlen);
+  if(n == -1)
+    return errno == EAGAIN || errno == EINTR;
+  if(n == 0)
+    return False;
+  cl->inlen += n;
+  return True;
+}
+
+/**
+ * The next complete line, without the newline, or NULL. Sets *overflow if
+ * the buffer is full and holds no line break at all.
+ */
+static char* control_line(ControlClient *cl, Bool *overflow) {
+  char *line = cl->in + cl->inpos;
+  char *end = (char *)memchr(line, '\n', cl->inlen - cl->inpos);
+  *overflow = (!end && cl->inpos == 0 && cl->inlen == (int)sizeof(cl->in));
+  if(!end)
+    return NULL;
+  cl->inpos = end + 1 - cl->in;
+  if(end > line && end[-1] == '\r')
+    end--;
+  *end = '\0';
+  return line;
+}
+
+/**
+ * Replies are one line each: newlines in text we did not write, window
+ * titles or what JS returned, become spaces.
+ */
+static char *control_oneline(char *text) {
+  char *p;
+  for(p = text; *p; p++)
+    if(*p == '\n' || *p == '\r')
+      *p = ' ';
+  return text;
+}
+
+/**
+ * Queue output. A client that lets more than CONTROL_OUT_MAX pile up is
+ * marked as overflowing and gets nothing more.
+ */
+static void control_printf(ControlClient *cl, const char *fmt, ...) {
+  va_list ap;
+  int n;
+  if(cl->overflow)
+    return;
+  for(;;) {
+    va_start(ap, fmt);
+    n = vsnprintf(cl->out + cl->outlen, cl->outcap - cl->outlen, fmt, ap);
+    va_end(ap);
+    if(n >= 0 && cl->outlen + n < cl->outcap)
+      break;
+    if(n < 0 || cl->outlen + n >= CONTROL_OUT_MAX) {
+      cl->overflow = True;
+      return;
+    }
+    cl->outcap = (cl->outcap ? cl->outcap * 2 : 4096) + n;
+    if(!(cl->out = (char *)realloc(cl->out, cl->outcap))) {
+      fprintf( stderr, "fatal: could not malloc() %lu bytes\n", cl->outcap);
+      exit( -1 );
+    }
+  }
+  cl->outlen += n;
+}
+
+/**
+ * Write out what the replies collected. Returns False if the client went
+ * away; whatever the socket would not take stays in the buffer.
+ */
+static Bool control_write(ControlClient *cl) {
+  ssize_t n;
+  size_t done = 0;
+  while(done < cl->outlen) {
+    // no SIGPIPE when the client is gone
+    n = send(cl->fd, cl->out + done, cl->outlen - done, MSG_NOSIGNAL);
+    if(n == -1) {
+      if(errno == EINTR)
+        continue;
+      if(errno == EAGAIN)
+        break;
+      return False;
+    }
+    done += n;
+  }
+  if(done > 0) {
+    memmove(cl->out, cl->out + done, cl->outlen - done);
+    cl->outlen -= done;
+  }
+  return True;
+}
+
+#endif
@@ -0,0 +1,843 @@
+/* This code is PUBLIC DOMAIN, and is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND. See the accompanying
+ * LICENSE file.
+ */
+
+#ifndef NWM_FAKE_BACKEND_H
+#define NWM_FAKE_BACKEND_H
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <X11/Xatom.h>
+#include "backend.h"
+
+#define FAKE_ROOT 1
+#define FAKE_MAX_GRABS 8
+#define FAKE_MIN_KEYCODE 8
+#define FAKE_MAX_KEYCODE 255
+#define FAKE_MAX_HEADS 16
+// where a real server would put RRScreenChangeNotify
+#define FAKE_SCREEN_CHANGE (LASTEvent + 53)
+
+typedef struct {
+  unsigned int button;
+  unsigned int mod;
+} FakeGrab;
+
+typedef struct {
+  KeySym keysym;
+  unsigned int mod;
+} FakeKeyGrab;
+
+typedef struct {
+  Bool exists;
+  XWindowAttributes wa;
+  char *name;
+  char *wm_class;
+  long pid;            // _NET_WM_PID
+  char *startup_id;    // _NET_STARTUP_ID
+  Window transient_for;
+  long event_mask;
+  FakeGrab grabs[FAKE_MAX_GRABS];
+  int ngrabs;
+} FakeWindow;
+
+/**
+ * Request counters, so benchmarks can report X traffic as well as time.
+ * "roundtrips" counts the requests that would block on a reply from a real
+ * server.
+ */
+typedef struct {
+  unsigned long requests;
+  unsigned long roundtrips;
+  unsigned long flushes;
+  unsigned long events;
+  unsigned long pixels;  // area filled or copied
+} FakeStats;
+
+/**
+ * An in-memory X server.
+ *
+ * Windows are kept in an array indexed by window id (the root is FAKE_ROOT),
+ * so every lookup is constant time and thousands of clients cost nothing to
+ * simulate. Events go into a queue; a pipe is kept readable while the queue
+ * is non-empty so that the libev watcher in NodeWM::Loop works unchanged.
+ *
+ * The sim* methods play the part of the X clients and the user: they create
+ * windows, ask for them to be mapped, move the pointer and press keys. Events
+ * are only generated for windows that selected the matching input mask, the
+ * same as a real server, so the event counts are meaningful.
+ */
+class FakeBackend : public Backend {
+private:
+  int width, height;
+  FakeWindow *windows;
+  unsigned int nwindows, capwindows;
+  XEvent *queue;
+  unsigned int qhead, qlen, qcap;
+  int fds[2];
+  Window focused;
+  int pointer_x, pointer_y;
+  FakeKeyGrab *keygrabs;
+  int nkeygrabs;
+  KeySym keymap[FAKE_MAX_KEYCODE + 1];
+  char **atoms;
+  int natoms;
+  unsigned long flushed_requests;
+  Pixmap next_pixmap;
+  XRectangle heads[FAKE_MAX_HEADS];
+  int nheads;
+  Bool screen_change_selected;
+
+  static void* grow(void *ptr, size_t size) {
+    void *p;
+    if(!(p = realloc(ptr, size))) {
+      fprintf( stderr, "fatal: could not realloc() %lu bytes\n", size);
+      exit( -1 );
+    }
+    return p;
+  }
+
+  FakeWindow* lookup(Window win) {
+    if(win < FAKE_ROOT || win >= FAKE_ROOT + nwindows)
+      return NULL;
+    FakeWindow *w = &windows[win - FAKE_ROOT];
+    return (w->exists ? w : NULL);
+  }
+
+  void push(XEvent *ev) {
+    if(qlen == qcap) {
+      unsigned int i, cap = (qcap ? qcap * 2 : 256);
+      XEvent *q = (XEvent *)grow(NULL, cap * sizeof(XEvent));
+      for(i = 0; i < qlen; i++)
+        q[i] = queue[(qhead + i) % qcap];
+      free(queue);
+      queue = q;
+      qcap = cap;
+      qhead = 0;
+    }
+    // requests are processed as they are made
+    ev->xany.serial = stats.requests;
+    ev->xany.send_event = False;
+    ev->xany.display = NULL;
+    queue[(qhead + qlen) % qcap] = *ev;
+    if(qlen++ == 0) {
+      char c = 0;
+      if(write(fds[1], &c, 1) < 0)
+        fprintf(stderr, "FakeBackend: could not signal event pipe\n");
+    }
+    stats.events++;
+  }
+
+  void pop(XEvent *ev) {
+    *ev = queue[qhead];
+    qhead = (qhead + 1) % qcap;
+    if(--qlen == 0) {
+      char c;
+      if(read(fds[0], &c, 1) < 0)
+        fprintf(stderr, "FakeBackend: could not drain event pipe\n");
+    }
+  }
+
+  /**
+   * Queue ev for win if win selected mask, and for its parent (the root) if
+   * the root selected parent_mask.
+   */
+  void deliver(Window win, long mask, long parent_mask, XEvent *ev) {
+    FakeWindow *w = lookup(win);
+    if(w && (w->event_mask & mask)) {
+      ev->xany.window = win;
+      push(ev);
+    }
+    if(win != FAKE_ROOT && parent_mask && (windows[0].event_mask & parent_mask)) {
+      ev->xany.window = FAKE_ROOT;
+      push(ev);
+    }
+  }
+
+  void configured(Window win, FakeWindow *w) {
+    XEvent ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = ConfigureNotify;
+    ev.xconfigure.event = win;
+    ev.xconfigure.window = win;
+    ev.xconfigure.x = w->wa.x;
+    ev.xconfigure.y = w->wa.y;
+    ev.xconfigure.width = w->wa.width;
+    ev.xconfigure.height = w->wa.height;
+    ev.xconfigure.border_width = w->wa.border_width;
+    ev.xconfigure.above = None;
+    ev.xconfigure.override_redirect = w->wa.override_redirect;
+    deliver(win, StructureNotifyMask, SubstructureNotifyMask, &ev);
+  }
+
+  void mapped(Window win) {
+    FakeWindow *w = lookup(win);
+    XEvent ev;
+    if(!w || w->wa.map_state == IsViewable)
+      return;
+    w->wa.map_state = IsViewable;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = MapNotify;
+    ev.xmap.event = win;
+    ev.xmap.window = win;
+    deliver(win, StructureNotifyMask, SubstructureNotifyMask, &ev);
+    memset(&ev, 0, sizeof(ev));
+    ev.type = Expose;
+    ev.xexpose.window = win;
+    ev.xexpose.width = w->wa.width;
+    ev.xexpose.height = w->wa.height;
+    deliver(win, ExposureMask, 0, &ev);
+  }
+
+  KeyCode keycodeFor(KeySym keysym) {
+    int i;
+    for(i = FAKE_MIN_KEYCODE; i <= FAKE_MAX_KEYCODE; i++) {
+      if(keymap[i] == keysym)
+        return i;
+      if(keymap[i] == NoSymbol) {
+        keymap[i] = keysym;
+        return i;
+      }
+    }
+    return 0;
+  }
+
+public:
+  FakeStats stats;
+
+  FakeBackend(int w, int h) :
+    width(w), height(h),
+    windows(NULL), nwindows(0), capwindows(0),
+    queue(NULL), qhead(0), qlen(0), qcap(0),
+    focused(PointerRoot), pointer_x(0), pointer_y(0),
+    keygrabs(NULL), nkeygrabs(0),
+    atoms(NULL), natoms(0),
+    flushed_requests(0),
+    next_pixmap(0x10000000),
+    nheads(1),
+    screen_change_selected(False)
+  {
+    if(pipe(fds) < 0) {
+      fprintf( stderr, "fatal: could not create fake event pipe\n");
+      exit( -1 );
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    memset(keymap, 0, sizeof(keymap));
+    memset(&stats, 0, sizeof(stats));
+    heads[0].x = heads[0].y = 0;
+    heads[0].width = w;
+    heads[0].height = h;
+    // the root window
+    simCreateWindow(0, 0, w, h, False, None);
+    windows[0].wa.map_state = IsViewable;
+  }
+
+  ~FakeBackend() {
+    unsigned int i;
+    for(i = 0; i < nwindows; i++) {
+      free(windows[i].name);
+      free(windows[i].wm_class);
+      free(windows[i].startup_id);
+    }
+    close(fds[0]);
+    close(fds[1]);
+    for(i = 0; i < (unsigned int)natoms; i++)
+      free(atoms[i]);
+    free(atoms);
+    free(keygrabs);
+    free(queue);
+    free(windows);
+  }
+
+  // connection
+
+  int connectionNumber() { return fds[0]; }
+  Window rootWindow() { return FAKE_ROOT; }
+  int displayWidth() { return width; }
+  int displayHeight() { return height; }
+  void sync() { stats.roundtrips++; }
+  void flush() {
+    // only count flushes that had something to send
+    if(stats.requests != flushed_requests) {
+      stats.flushes++;
+      flushed_requests = stats.requests;
+    }
+  }
+  unsigned long fence() { return ++stats.requests; }
+  void grabServer() { stats.requests++; }
+  void ungrabServer() { stats.requests++; }
+
+  int screenChangeEvent() {
+    stats.roundtrips++;
+    screen_change_selected = True;
+    return FAKE_SCREEN_CHANGE;
+  }
+  void screenChanged(XEvent *ev) {}
+  int queryScreens(XRectangle *out, int max) {
+    int i;
+    stats.roundtrips++;
+    for(i = 0; i < nheads && i < max; i++)
+      out[i] = heads[i];
+    return i;
+  }
+
+  // event source
+
+  int pending() { return qlen; }
+  int queued() { return qlen; }
+
+  void nextEvent(XEvent *ev) {
+    if(qlen == 0) {
+      // a real server would block here; there is nobody to wake us up
+      memset(ev, 0, sizeof(XEvent));
+      ev->type = MappingNotify;
+      return;
+    }
+    pop(ev);
+  }
+
+  void maskEvent(long mask, XEvent *ev) {
+    unsigned int i, j;
+    XEvent head;
+    for(i = 0; i < qlen; i++) {
+      XEvent *e = &queue[(qhead + i) % qcap];
+      long m = 0;
+      switch(e->type) {
+        case ButtonPress: m = ButtonPressMask; break;
+        case ButtonRelease: m = ButtonReleaseMask; break;
+        case MotionNotify: m = PointerMotionMask; break;
+        case Expose: m = ExposureMask; break;
+        case ConfigureRequest:
+        case MapRequest: m = SubstructureRedirectMask; break;
+      }
+      if(mask & m) {
+        // like XMaskEvent, take it out of the queue and leave the rest in order
+        *ev = *e;
+        for(j = i; j > 0; j--)
+          queue[(qhead + j) % qcap] = queue[(qhead + j - 1) % qcap];
+        pop(&head);
+        return;
+      }
+    }
+    // nothing left to wait for, end whatever grab the caller is running
+    memset(ev, 0, sizeof(XEvent));
+    ev->type = ButtonRelease;
+    ev->xbutton.window = FAKE_ROOT;
+  }
+
+  // window tree and attributes
+
+  Status queryTree(Window win, Window **children, unsigned int *num) {
+    unsigned int i, n = 0;
+    Window *list;
+    stats.roundtrips++;
+    if(win != FAKE_ROOT) {
+      *children = NULL;
+      *num = 0;
+      return lookup(win) != NULL;
+    }
+    list = (Window *)grow(NULL, (nwindows > 1 ? nwindows : 1) * sizeof(Window));
+    for(i = 1; i < nwindows; i++)
+      if(windows[i].exists)
+        list[n++] = FAKE_ROOT + i;
+    *children = list;
+    *num = n;
+    return 1;
+  }
+
+  Status getWindowAttributes(Window win, XWindowAttributes *wa) {
+    FakeWindow *w = lookup(win);
+    stats.roundtrips++;
+    if(!w)
+      return 0;
+    *wa = w->wa;
+    return 1;
+  }
+
+  Status getTransientForHint(Window win, Window *prop) {
+    FakeWindow *w = lookup(win);
+    stats.roundtrips++;
+    if(!w || w->transient_for == None)
+      return 0;
+    *prop = w->transient_for;
+    return 1;
+  }
+
+  Status getWMProtocols(Window win, Atom **protocols, int *num) {
+    stats.roundtrips++;
+    *protocols = NULL;
+    *num = 0;
+    return 0;
+  }
+
+  Bool fetchName(Window win, char *name, int size) {
+    FakeWindow *w = lookup(win);
+    stats.roundtrips++;
+    if(!w || !w->name)
+      return False;
+    strncpy(name, w->name, size - 1);
+    name[size - 1] = '\0';
+    return True;
+  }
+
+  Bool fetchClass(Window win, char *wm_class, int size) {
+    FakeWindow *w = lookup(win);
+    stats.roundtrips++;
+    if(!w || !w->wm_class)
+      return False;
+    strncpy(wm_class, w->wm_class, size - 1);
+    wm_class[size - 1] = '\0';
+    return True;
+  }
+
+  long getWindowPid(Window win) {
+    FakeWindow *w = lookup(win);
+    stats.roundtrips++;
+    return (w ? w->pid : 0);
+  }
+
+  Bool getStartupId(Window win, char *id, int size) {
+    FakeWindow *w = lookup(win);
+    stats.roundtrips++;
+    if(!w || !w->startup_id)
+      return False;
+    strncpy(id, w->startup_id, size - 1);
+    id[size - 1] = '\0';
+    return True;
+  }
+
+  void freeList(void *list) { free(list); }
+
+  Atom internAtom(const char *name) {
+    int i;
+    stats.roundtrips++;
+    for(i = 0; i < natoms; i++)
+      if(strcmp(atoms[i], name) == 0)
+        return XA_LAST_PREDEFINED + 1 + i;
+    atoms = (char **)grow(atoms, (natoms + 1) * sizeof(char *));
+    atoms[natoms] = strdup(name);
+    return XA_LAST_PREDEFINED + 1 + natoms++;
+  }
+
+  // configure and map
+
+  void selectInput(Window win, long mask) {
+    FakeWindow *w = lookup(win);
+    stats.requests++;
+    if(w)
+      w->event_mask = mask;
+  }
+
+  void moveWindow(Window win, int x, int y) {
+    FakeWindow *w = lookup(win);
+    stats.requests++;
+    if(w) {
+      w->wa.x = x;
+      w->wa.y = y;
+      configured(win, w);
+    }
+  }
+
+  void resizeWindow(Window win, unsigned int width, unsigned int height) {
+    FakeWindow *w = lookup(win);
+    stats.requests++;
+    if(w) {
+      w->wa.width = width;
+      w->wa.height = height;
+      configured(win, w);
+    }
+  }
+
+  void moveResizeWindow(Window win, int x, int y, unsigned int width, unsigned int height) {
+    FakeWindow *w = lookup(win);
+    stats.requests++;
+    if(w) {
+      w->wa.x = x;
+      w->wa.y = y;
+      w->wa.width = width;
+      w->wa.height = height;
+      configured(win, w);
+    }
+  }
+
+  void mapWindow(Window win) {
+    stats.requests++;
+    mapped(win);
+  }
+
+  // the stacking order itself is not simulated; XRestackWindows sends a
+  // ConfigureWindow for each window below the first
+  void raiseWindow(Window win) { stats.requests++; }
+  void restackWindows(Window *windows, int num) { stats.requests += num - 1; }
+
+  void sendEvent(Window win, long mask, XEvent *ev) { stats.requests++; }
+
+  // focus
+
+  void setInputFocus(Window win) {
+    XEvent ev;
+    stats.requests++;
+    if(win == focused)
+      return;
+    memset(&ev, 0, sizeof(ev));
+    ev.xfocus.mode = NotifyNormal;
+    ev.xfocus.detail = NotifyNonlinear;
+    if(lookup(focused)) {
+      ev.type = FocusOut;
+      deliver(focused, FocusChangeMask, 0, &ev);
+    }
+    focused = win;
+    if(lookup(win)) {
+      ev.type = FocusIn;
+      deliver(win, FocusChangeMask, 0, &ev);
+    }
+  }
+
+  // grabs
+
+  void grabButton(unsigned int button, unsigned int mod, Window win) {
+    FakeWindow *w = lookup(win);
+    stats.requests++;
+    if(w && w->ngrabs < FAKE_MAX_GRABS) {
+      w->grabs[w->ngrabs].button = button;
+      w->grabs[w->ngrabs].mod = mod;
+      w->ngrabs++;
+    }
+  }
+
+  void ungrabButton(Window win) {
+    FakeWindow *w = lookup(win);
+    stats.requests++;
+    if(w)
+      w->ngrabs = 0;
+  }
+
+  void grabKey(KeySym keysym, unsigned int mod, Window win) {
+    stats.requests++;
+    keycodeFor(keysym);
+    keygrabs = (FakeKeyGrab *)grow(keygrabs, (nkeygrabs + 1) * sizeof(FakeKeyGrab));
+    keygrabs[nkeygrabs].keysym = keysym;
+    keygrabs[nkeygrabs].mod = mod;
+    nkeygrabs++;
+  }
+
+  void ungrabKeys(Window win) {
+    stats.requests++;
+    nkeygrabs = 0;
+  }
+
+  KeySym keycodeToKeysym(KeyCode keycode) { return keymap[keycode]; }
+
+  Bool grabPointer(Window win, long mask) {
+    stats.roundtrips++;
+    return True;
+  }
+
+  void ungrabPointer() { stats.requests++; }
+
+  Bool queryPointer(Window win, int *x, int *y) {
+    stats.roundtrips++;
+    *x = pointer_x;
+    *y = pointer_y;
+    return True;
+  }
+
+  // drawing: counted, not rendered. Text is 6 pixels per character, like
+  // the "fixed" font
+
+  Window createWindow(int x, int y, unsigned int width, unsigned int height,
+                      unsigned long background, long mask) {
+    stats.requests++;
+    Window win = simCreateWindow(x, y, width, height, True, None);
+    windows[win - FAKE_ROOT].event_mask = mask;
+    return win;
+  }
+
+  void destroyWindow(Window win) {
+    stats.requests++;
+    simDestroyWindow(win);
+  }
+
+  Pixmap createPixmap(unsigned int width, unsigned int height) {
+    stats.requests++;
+    return next_pixmap++;
+  }
+
+  void freePixmap(Pixmap pixmap) { stats.requests++; }
+
+  unsigned long allocColor(const char *name) {
+    unsigned long pixel = 0;
+    stats.roundtrips++;
+    while(*name)
+      pixel = pixel * 31 + *name++;
+    return pixel & 0xffffff;
+  }
+
+  Bool loadFont(const char *name, int *ascent, int *descent) {
+    stats.roundtrips++;
+    *ascent = 10;
+    *descent = 3;
+    return True;
+  }
+
+  int textWidth(const char *text, int len) { return len * 6; }
+
+  void fillRectangle(Drawable d, unsigned long pixel, int x, int y,
+                     unsigned int width, unsigned int height) {
+    stats.requests++;
+    stats.pixels += width * height;
+  }
+
+  void drawString(Drawable d, unsigned long pixel, int x, int y, const char *text, int len) {
+    stats.requests++;
+  }
+
+  void copyArea(Drawable src, Drawable dst, int x, int y, unsigned int width, unsigned int height) {
+    stats.requests++;
+    stats.pixels += width * height;
+  }
+
+  // simulation: the X clients and the user
+
+  /**
+   * Plug, unplug or rotate monitors: the new set of heads replaces the old
+   * one and the screen grows or shrinks to hold them.
+   */
+  void simSetScreens(XRectangle *rects, int n) {
+    XEvent ev;
+    int i;
+    nheads = (n < FAKE_MAX_HEADS ? n : FAKE_MAX_HEADS);
+    width = height = 0;
+    for(i = 0; i < nheads; i++) {
+      heads[i] = rects[i];
+      if(heads[i].x + heads[i].width > width)
+        width = heads[i].x + heads[i].width;
+      if(heads[i].y + heads[i].height > height)
+        height = heads[i].y + heads[i].height;
+    }
+    windows[0].wa.width = width;
+    windows[0].wa.height = height;
+    if(!screen_change_selected)
+      return;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = FAKE_SCREEN_CHANGE;
+    ev.xany.window = FAKE_ROOT;
+    push(&ev);
+  }
+
+  /**
+   * A client sets its WM_NAME.
+   */
+  void simSetName(Window win, const char *name) {
+    FakeWindow *w = lookup(win);
+    XEvent ev;
+    if(!w)
+      return;
+    free(w->name);
+    w->name = strdup(name);
+    memset(&ev, 0, sizeof(ev));
+    ev.type = PropertyNotify;
+    ev.xproperty.atom = XA_WM_NAME;
+    ev.xproperty.state = PropertyNewValue;
+    deliver(win, PropertyChangeMask, 0, &ev);
+  }
+
+  /**
+   * A client sets its WM_CLASS, before mapping the window.
+   */
+  void simSetClass(Window win, const char *wm_class) {
+    FakeWindow *w = lookup(win);
+    if(!w)
+      return;
+    free(w->wm_class);
+    w->wm_class = strdup(wm_class);
+  }
+
+  /**
+   * A client sets _NET_WM_PID and, if it got one, _NET_STARTUP_ID.
+   */
+  void simSetPid(Window win, long pid, const char *startup_id) {
+    FakeWindow *w = lookup(win);
+    if(!w)
+      return;
+    w->pid = pid;
+    free(w->startup_id);
+    w->startup_id = (startup_id ? strdup(startup_id) : NULL);
+  }
+
+  /**
+   * Bind a keycode to a keysym, e.g. to replay key events recorded on a
+   * server with a different keymap.
+   */
+  void simSetKeysym(KeyCode keycode, KeySym keysym) {
+    keymap[keycode] = keysym;
+  }
+
+  /**
+   * Drop all queued events, e.g. the ConfigureNotify replies to our own
+   * requests when replaying a trace that already contains them.
+   */
+  void simDiscardEvents() {
+    XEvent ev;
+    while(qlen > 0)
+      pop(&ev);
+  }
+
+  /**
+   * Create an unmapped top-level window, like a client calling XCreateWindow.
+   */
+  Window simCreateWindow(int x, int y, int w, int h, Bool override_redirect, Window transient_for) {
+    FakeWindow *fw;
+    XEvent ev;
+    if(nwindows == capwindows) {
+      capwindows = (capwindows ? capwindows * 2 : 64);
+      windows = (FakeWindow *)grow(windows, capwindows * sizeof(FakeWindow));
+    }
+    fw = &windows[nwindows];
+    memset(fw, 0, sizeof(FakeWindow));
+    fw->exists = True;
+    fw->wa.x = x;
+    fw->wa.y = y;
+    fw->wa.width = w;
+    fw->wa.height = h;
+    fw->wa.root = FAKE_ROOT;
+    fw->wa.map_state = IsUnmapped;
+    fw->wa.override_redirect = override_redirect;
+    fw->transient_for = transient_for;
+    Window win = FAKE_ROOT + nwindows++;
+    if(win != FAKE_ROOT) {
+      memset(&ev, 0, sizeof(ev));
+      ev.type = CreateNotify;
+      ev.xcreatewindow.parent = FAKE_ROOT;
+      ev.xcreatewindow.window = win;
+      ev.xcreatewindow.x = x;
+      ev.xcreatewindow.y = y;
+      ev.xcreatewindow.width = w;
+      ev.xcreatewindow.height = h;
+      ev.xcreatewindow.override_redirect = override_redirect;
+      deliver(win, 0, SubstructureNotifyMask, &ev);
+    }
+    return win;
+  }
+
+  /**
+   * A client maps its window: redirected to the window manager as a
+   * MapRequest unless the window is override_redirect.
+   */
+  void simMapWindow(Window win) {
+    FakeWindow *w = lookup(win);
+    XEvent ev;
+    if(!w || w->wa.map_state == IsViewable)
+      return;
+    if(!w->wa.override_redirect && (windows[0].event_mask & SubstructureRedirectMask)) {
+      memset(&ev, 0, sizeof(ev));
+      ev.type = MapRequest;
+      ev.xmaprequest.parent = FAKE_ROOT;
+      ev.xmaprequest.window = win;
+      push(&ev);
+      return;
+    }
+    mapped(win);
+  }
+
+  void simDestroyWindow(Window win) {
+    FakeWindow *w = lookup(win);
+    XEvent ev;
+    if(!w || win == FAKE_ROOT)
+      return;
+    memset(&ev, 0, sizeof(ev));
+    if(w->wa.map_state == IsViewable) {
+      w->wa.map_state = IsUnmapped;
+      ev.type = UnmapNotify;
+      ev.xunmap.event = win;
+      ev.xunmap.window = win;
+      deliver(win, StructureNotifyMask, SubstructureNotifyMask, &ev);
+    }
+    ev.type = DestroyNotify;
+    ev.xdestroywindow.event = win;
+    ev.xdestroywindow.window = win;
+    deliver(win, StructureNotifyMask, SubstructureNotifyMask, &ev);
+    w->exists = False;
+    free(w->name);
+    w->name = NULL;
+    free(w->wm_class);
+    w->wm_class = NULL;
+    free(w->startup_id);
+    w->startup_id = NULL;
+    w->pid = 0;
+    if(focused == win)
+      focused = PointerRoot;
+  }
+
+  void simEnterWindow(Window win) {
+    FakeWindow *w = lookup(win);
+    XEvent ev;
+    if(!w)
+      return;
+    pointer_x = w->wa.x + w->wa.width / 2;
+    pointer_y = w->wa.y + w->wa.height / 2;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = EnterNotify;
+    ev.xcrossing.root = FAKE_ROOT;
+    ev.xcrossing.x_root = pointer_x;
+    ev.xcrossing.y_root = pointer_y;
+    ev.xcrossing.mode = NotifyNormal;
+    ev.xcrossing.detail = NotifyNonlinear;
+    ev.xcrossing.focus = (focused == win);
+    deliver(win, EnterWindowMask, 0, &ev);
+  }
+
+  void simButtonPress(Window win, unsigned int button, unsigned int state) {
+    FakeWindow *w = lookup(win);
+    XEvent ev;
+    int i;
+    Bool grabbed = False;
+    if(!w)
+      return;
+    for(i = 0; i < w->ngrabs && !grabbed; i++)
+      grabbed = (w->grabs[i].button == AnyButton || w->grabs[i].button == button)
+             && (w->grabs[i].mod == AnyModifier || w->grabs[i].mod == state);
+    if(!grabbed && !(w->event_mask & ButtonPressMask))
+      return;
+    memset(&ev, 0, sizeof(ev));
+    ev.type = ButtonPress;
+    ev.xbutton.window = win;
+    ev.xbutton.root = FAKE_ROOT;
+    ev.xbutton.x = pointer_x - w->wa.x;
+    ev.xbutton.y = pointer_y - w->wa.y;
+    ev.xbutton.x_root = pointer_x;
+    ev.xbutton.y_root = pointer_y;
+    ev.xbutton.button = button;
+    ev.xbutton.state = state;
+    push(&ev);
+  }
+
+  void simKeyPress(KeySym keysym, unsigned int state) {
+    XEvent ev;
+    int i;
+    for(i = 0; i < nkeygrabs; i++) {
+      if(keygrabs[i].keysym == keysym
+      && (keygrabs[i].mod == AnyModifier || keygrabs[i].mod == state)) {
+        memset(&ev, 0, sizeof(ev));
+        ev.type = KeyPress;
+        ev.xkey.window = FAKE_ROOT;
+        ev.xkey.root = FAKE_ROOT;
+        ev.xkey.x = pointer_x;
+        ev.xkey.y = pointer_y;
+        ev.xkey.x_root = pointer_x;
+        ev.xkey.y_root = pointer_y;
+        ev.xkey.keycode = keycodeFor(keysym);
+        ev.xkey.state = state;
+        push(&ev);
+        return;
+      }
+    }
+  }
+};
+
+#endif
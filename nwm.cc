@@ -11,6 +11,7 @@
 #include <locale.h>
 #include <stdarg.h>
 #include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -29,36 +30,77 @@
 #include <unistd.h>   // So we got the profile for 10 seconds
 #define NIL (0)       // A name for the void pointer
 #define MAXWIN 512
+#define MAXHEADS 16
 #include "event_names.h"
+// core events with a name; GenericEvent, the last below LASTEvent, has none
+#define EVENT_NAMES ((int)(sizeof(event_names) / sizeof(event_names[0])))
+#include "backend.h"
+#include "fake_backend.h"
+#include "trace.h"
+#include "bar.h"
+#include "control.h"
 
 
 using namespace node;
 using namespace v8;
 
+// tracing in the event path, off unless built with -DNWM_DEBUG
+#ifdef NWM_DEBUG
+#define debug(...) fprintf(stderr, __VA_ARGS__)
+#else
+#define debug(...)
+#endif
+
 typedef struct {
   unsigned int mod;
   KeySym keysym;
 } Key;
 
+typedef struct {
+  const char *name;
+  KeySym keysym;
+} KeysymName;
+
+// keysyms_by_name and keysyms_by_sym, generated from keysymdef.js by wscript
+#include "keysyms.h"
+
 typedef struct Monitor Monitor;
 typedef struct Client Client;
+// Client::dirty, changes not sent to the server yet
+enum {
+  DirtyPosition = 1,
+  DirtySize = 2
+};
+
 struct Client {
   int id;
   int x, y, width, height;
+  unsigned int dirty;
+  Client *dnext;
   Client *next;
+  char name[BAR_TEXT];
   Client *snext;
   Monitor *mon;
   Window win;
+  // dialogs are kept above this window
+  Window transient_for;
+  // WM_CLASS, read the first time a listener filter needs it
+  char wm_class[64];
+  Bool class_fetched;
 };
 
 struct Monitor {
   int id;
   int x, y, width, height;
   Client *clients;
-//  Client *sel;
-//  Client *stack;
+  Client *sel;
+  // stacking order, top first, linked by snext
+  Client *stack;
   Monitor *next;
   Window barwin;
+  Bar *bar;
+  // geometry changed, or clients moved here, in the last updateGeometry
+  Bool changed;
 };
 
 // make these classes of their own
@@ -72,28 +114,163 @@ enum callback_map {
   onConfigureRequest,
   onKeyPress,
   onEnterNotify,
+  onCommand,
+  onScreenChange,
+  onMapNotify,
   onLast
 };
 
+// names used with on(), in callback_map order
+static const char *callback_names[onLast] = {
+  "add",
+  "remove",
+  "rearrange",
+  "buttonPress",
+  "mouseDrag",
+  "configureRequest",
+  "keyPress",
+  "enterNotify",
+  "command",
+  "screenChange",
+  "mapNotify"
+};
+
+/**
+ * A listener and its filters. Filters are checked before anything is
+ * converted to JS values, so events nobody wants never reach V8. A zero
+ * (or -1 for modifiers) filter matches everything.
+ */
+typedef struct Listener Listener;
+struct Listener {
+  Persistent<Function> callback;
+  int id;                  // window id
+  unsigned int buttons;    // bit per button
+  int modifiers;           // exact modifier state, Lock and NumLock ignored
+  KeySym keysym;
+  char *wm_class;
+  Bool removed;            // off() while emitting, freed afterwards
+  Listener *next;
+};
+
+// what an event is about, checked against the listener filters
+typedef struct {
+  Client *c;
+  unsigned int button;
+  unsigned int state;
+  KeySym keysym;
+} EventInfo;
+
+#define CLEANMASK(mask) ((mask) & ~(LockMask|Mod2Mask) & (ShiftMask|ControlMask|Mod1Mask|Mod3Mask|Mod4Mask|Mod5Mask))
+
+// ControlClient::events, what a control socket client subscribed to
+enum {
+  ControlAdd = 1,
+  ControlRemove = 2,
+  ControlFocus = 4
+};
+
+extern char **environ;
+
+// how long a launch waits for its window
+#define LAUNCH_TIMEOUT 30.
+
+/**
+ * A program started with spawn(). Its first window is recognized by
+ * _NET_STARTUP_ID (we pass DESKTOP_STARTUP_ID) or else _NET_WM_PID, and
+ * is managed with the workspace it was started for. After that the launch
+ * only waits to be reaped: programs started from it inherit the startup
+ * id, and their windows must not land on its workspace. A launch whose
+ * window did not come within LAUNCH_TIMEOUT is retired the same way, so
+ * daemons and programs without windows do not cost every new window a
+ * lookup for good.
+ */
+typedef struct Launch Launch;
+struct Launch {
+  ev_child child;          // first, so the watcher is the launch
+  pid_t pid;
+  char startup_id[64];
+  Persistent<Value> workspace;
+  double started;
+  Bool exited;
+  Bool retired;            // managed or timed out, on children
+  Launch *next;
+};
+
 
 class NodeWM: ObjectWrap
 {
 private:
-  // X11
-  Display *dpy;
-  GC gc;
-  Window wnd;
+  // X11, or the in-memory server when simulating (then fake == be)
+  Backend *be;
+  FakeBackend *fake;
   Window root;
-  Window selected;
+  // all monitors, and the selected one (new windows, focus)
+  Monitor *mons;
   Monitor* monit;
+  int next_monitor;
+  // RandR screen change event type, -1 without RandR, and one seen
+  int rr_event;
+  Bool screen_dirty;
+  // bar font, NULL without a bar; the text shared by all bars
+  char *bar_font;
+  char bar_text[BarSegments][BAR_TEXT];
+  // clients with changes made during this loop iteration, see Commit
+  Client *dirty;
+  // focus requested during this loop iteration
+  Client *focus_next;
+  Bool focus_dirty;
+  // stacking order changed during this loop iteration
+  Bool stack_dirty;
+  Window *stack_buf;
+  int stack_size;
+  // the order on the server as of the last restack, top first
+  Window *stack_last;
+  int stack_last_n, stack_last_size;
+  // we moved or restacked windows in this loop iteration; crossing
+  // events with a serial below layout_serial were caused by that
+  Bool layout_moved;
+  unsigned long layout_serial;
+  Atom wm_protocols, wm_take_focus;
+  // what we selected and grabbed, see UpdateEventMasks
+  long root_mask, client_mask;
+  Bool grab_buttons, grab_keys;
   // screen dimensions
   int screen, screen_width, screen_height;
   // window id
   int next_index;
-  // callback storage
-  Persistent<Function>* callbacks[onLast];
+  // listeners, in the order they were added
+  Listener *listeners[onLast];
+  // nested Emit depth, and listeners removed meanwhile
+  int emitting;
+  Bool listeners_removed;
+  // per event: listener calls, and events no listener wanted
+  unsigned long emit_calls[onLast];
+  unsigned long emit_filtered[onLast];
   // grabbed keys
-  Key keys[];
+  Key *keys;
+  int nkeys;
+  // event trace being recorded
+  TraceWriter *recorder;
+  // event trace being replayed
+  TraceReader *replay;
+  TraceWindowMap replay_map;
+  TraceRecord replay_rec;
+  XEvent replay_ev;
+  double replay_start;
+  unsigned long replay_count;
+  TraceLatency latency[EVENT_NAMES];
+  Persistent<Function> replay_cb;
+  ev_timer replay_timer;
+  // control socket
+  int control_fd;
+  char *control_path;
+  ev_io control_watcher;
+  ControlClient *control_clients;
+  // programs started with spawn() whose window has not shown up yet, and
+  // the matched ones still running
+  Launch *launches;
+  Launch *children;
+  unsigned long launch_count;
 public:
 
   static Persistent<FunctionTemplate> s_ct;
@@ -113,16 +290,43 @@ public:
 
     // callbacks
     NODE_SET_PROTOTYPE_METHOD(s_ct, "on", OnCallback);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "off", OffCallback);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "stats", Stats);
 
     // API
     NODE_SET_PROTOTYPE_METHOD(s_ct, "moveWindow", MoveWindow);
     NODE_SET_PROTOTYPE_METHOD(s_ct, "resizeWindow", ResizeWindow);
     NODE_SET_PROTOTYPE_METHOD(s_ct, "focusWindow", FocusWindow);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "raise", Raise);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "lower", Lower);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "setStack", SetStack);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "setWorkspaces", SetWorkspaces);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "setStatus", SetStatus);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "keysymName", KeysymToName);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "keysymFromName", KeysymFromName);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "spawn", Spawn);
 
     // Setting up
     NODE_SET_PROTOTYPE_METHOD(s_ct, "setup", Setup);
     NODE_SET_PROTOTYPE_METHOD(s_ct, "scan", Scan);
     NODE_SET_PROTOTYPE_METHOD(s_ct, "loop", Loop);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "dispatch", Dispatch);
+
+    // Event traces
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "record", Record);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "replay", Replay);
+
+    // Simulation (setup({ fake: { width, height } }) only)
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "simCreateWindow", SimCreateWindow);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "simMapWindow", SimMapWindow);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "simDestroyWindow", SimDestroyWindow);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "simEnterWindow", SimEnterWindow);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "simButtonPress", SimButtonPress);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "simKeyPress", SimKeyPress);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "simSetName", SimSetName);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "simSetPid", SimSetPid);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "simSetScreens", SimSetScreens);
+    NODE_SET_PROTOTYPE_METHOD(s_ct, "simStats", SimStats);
 
     // FINALLY: export the current function template
     target->Set(String::NewSymbol("NodeWM"),
@@ -131,22 +335,94 @@ public:
 
   // C++ constructor
   NodeWM() :
+    be(NULL),
+    fake(NULL),
+    mons(NULL),
+    monit(NULL),
+    next_monitor(0),
+    rr_event(-1),
+    screen_dirty(False),
+    bar_font(NULL),
+    dirty(NULL),
+    focus_next(NULL),
+    focus_dirty(False),
+    stack_dirty(False),
+    stack_buf(NULL),
+    stack_size(0),
+    stack_last(NULL),
+    stack_last_n(0),
+    stack_last_size(0),
+    layout_moved(False),
+    layout_serial(0),
+    root_mask(0),
+    client_mask(StructureNotifyMask),
+    grab_buttons(False),
+    grab_keys(False),
     next_index(1),
-    monit(NULL)
+    keys(NULL),
+    nkeys(0),
+    recorder(NULL),
+    replay(NULL),
+    control_fd(-1),
+    control_path(NULL),
+    control_clients(NULL),
+    launches(NULL),
+    children(NULL),
+    launch_count(0)
   {
+    memset(&replay_map, 0, sizeof(replay_map));
+    memset(bar_text, 0, sizeof(bar_text));
+    memset(listeners, 0, sizeof(listeners));
+    emitting = 0;
+    listeners_removed = False;
+    memset(emit_calls, 0, sizeof(emit_calls));
+    memset(emit_filtered, 0, sizeof(emit_filtered));
   }
 
   ~NodeWM()
   {
+    if(recorder)
+      trace_close_writer(recorder);
+    if(replay)
+      trace_close_reader(replay);
+    trace_map_free(&replay_map);
+    while(control_clients)
+      ControlClose(this, control_clients);
+    if(control_fd != -1) {
+      ev_io_stop(EV_DEFAULT_ &control_watcher);
+      close(control_fd);
+      unlink(control_path);
+      free(control_path);
+    }
+    while(launches)
+      freeLaunch(this, launches);
+    while(children)
+      freeLaunch(this, children);
+    while(mons) {
+      Monitor *m = mons;
+      mons = m->next;
+      if(m->bar)
+        bar_destroy(m->bar, be);
+      free(m);
+    }
+    free(bar_font);
+    for(int i = 0; i < onLast; i++) {
+      while(listeners[i]) {
+        Listener *l = listeners[i];
+        listeners[i] = l->next;
+        freeListener(l);
+      }
+    }
+    delete be;
+    free(keys);
+    free(stack_buf);
+    free(stack_last);
   }
 
   // New method for v8
   static Handle<Value> New(const Arguments& args) {
     HandleScope scope;
     NodeWM* hw = new NodeWM();
-    for(int i = 0; i < onLast; i++) {
-      hw->callbacks[i] = NULL;
-    }
     // use ObjectWrap.Wrap to store hw in this
     hw->Wrap(args.This());
     // return this
@@ -155,47 +431,317 @@ public:
 
   // EVENTS
 
+  static int eventByName(Handle<Value> name) {
+    v8::String::AsciiValue value(name);
+    for(int i = 0; i < onLast; i++) {
+      if( strcmp(*value, callback_names[i]) == 0 ) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  /**
+   * on(name, callback, [filter]) adds a listener. filter can have:
+   *
+   *   id: window id
+   *   buttons: [1, 3]
+   *   modifiers: exact modifier mask, e.g. Mod4Mask|ShiftMask
+   *   keysym: a keysym, or its name ('XK_Return')
+   *   wm_class: e.g. 'XTerm'
+   *
+   * on(name, null) removes all the listeners for name, as off(name) does.
+   * An unknown keysym name or a bad buttons list throws a TypeError.
+   */
   static Handle<Value> OnCallback(const Arguments& args) {
     HandleScope scope;
     // extract from args.this
     NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    Listener *l, **tl;
 
-    v8::Local<v8::String> map[onLast+1] = {
-        v8::String::New("add"),
-        v8::String::New("remove"), 
-        v8::String::New("rearrange"),
-        v8::String::New("buttonPress"),
-        v8::String::New("configureRequest"),
-        v8::String::New("keyPress"),
-        v8::String::New("enterNotify"),
-      };
-
-    v8::Local<v8::String> value  = Local<v8::String>::Cast(args[0]);
-    int selected = -1;
-    for(int i = 0; i < onLast; i++) {
-      if( strcmp(*v8::String::AsciiValue(value),  *v8::String::AsciiValue(map[i])) == 0 ) {
-        selected = i;
-        break;        
-      }
-    }
+    int selected = eventByName(args[0]);
     if(selected == -1) {
       return Undefined();
     }
-    // store function
-    hw->callbacks[selected] = cb_persist(args[1]);
+    if(!args[1]->IsFunction()) {
+      RemoveListeners(hw, selected, Handle<Value>());
+      return Undefined();
+    }
+    // check the whole filter before anything is allocated; a filter we
+    // cannot honour must not turn into a listener for everything
+    int id = 0, modifiers = -1;
+    unsigned int mask = 0;
+    KeySym keysym = NoSymbol;
+    Local<Value> wm_class;
+    if(args[2]->IsObject()) {
+      Local<Object> filter = args[2]->ToObject();
+      Local<Value> value;
+      if((value = filter->Get(String::NewSymbol("id")))->IsNumber())
+        id = value->IntegerValue();
+      value = filter->Get(String::NewSymbol("buttons"));
+      if(!value->IsUndefined()) {
+        if(!value->IsArray() || Local<Array>::Cast(value)->Length() == 0) {
+          return ThrowException(Exception::TypeError(String::New("buttons must be a non-empty array")));
+        }
+        Local<Array> buttons = Local<Array>::Cast(value);
+        for(unsigned int i = 0; i < buttons->Length(); i++) {
+          Local<Value> button = buttons->Get(i);
+          if(!button->IsNumber() || button->IntegerValue() < Button1 || button->IntegerValue() > 31) {
+            return ThrowException(Exception::TypeError(String::New("buttons must be numbers from 1 to 31")));
+          }
+          mask |= (1 << button->IntegerValue());
+        }
+      }
+      if((value = filter->Get(String::NewSymbol("modifiers")))->IsNumber())
+        modifiers = CLEANMASK(value->IntegerValue());
+      value = filter->Get(String::NewSymbol("keysym"));
+      if(value->IsNumber()) {
+        keysym = value->IntegerValue();
+      } else if(value->IsString()) {
+        String::Utf8Value name(value);
+        if((keysym = keysymFromName(*name)) == NoSymbol) {
+          char message[128];
+          snprintf(message, sizeof(message), "Unknown keysym %s", *name);
+          return ThrowException(Exception::TypeError(String::New(message)));
+        }
+      }
+      if((value = filter->Get(String::NewSymbol("wm_class")))->IsString())
+        wm_class = value;
+    }
+    if(!(l = (Listener *)calloc(1, sizeof(Listener)))) {
+      fprintf( stderr, "fatal: could not malloc() %lu bytes\n", sizeof(Listener));
+      exit( -1 );
+    }
+    l->callback = Persistent<Function>::New(Local<Function>::Cast(args[1]));
+    l->id = id;
+    l->buttons = mask;
+    l->modifiers = modifiers;
+    l->keysym = keysym;
+    if(!wm_class.IsEmpty())
+      l->wm_class = strdup(*String::Utf8Value(wm_class));
+    // appended, so listeners run in the order they were added
+    for(tl = &hw->listeners[selected]; *tl; tl = &(*tl)->next);
+    *tl = l;
+    UpdateEventMasks(hw);
 
     return Undefined();
   }
 
-  void Emit(callback_map event, int argc, Handle<Value> argv[]) {
+  /**
+   * off(name, callback) removes the listeners with that callback,
+   * off(name) all of them.
+   */
+  static Handle<Value> OffCallback(const Arguments& args) {
+    HandleScope scope;
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    int selected = eventByName(args[0]);
+    if(selected != -1) {
+      RemoveListeners(hw, selected, (args[1]->IsFunction() ? args[1] : Handle<Value>()));
+    }
+    return Undefined();
+  }
+
+  static void RemoveListeners(NodeWM* hw, int event, Handle<Value> callback) {
+    Listener *l;
+    for(l = hw->listeners[event]; l; l = l->next) {
+      if(!callback.IsEmpty() && !l->callback->StrictEquals(callback))
+        continue;
+      // a listener may remove itself (or others) while being called
+      l->removed = True;
+      hw->listeners_removed = True;
+    }
+    if(!hw->emitting) {
+      SweepListeners(hw);
+    }
+    UpdateEventMasks(hw);
+  }
+
+  static void SweepListeners(NodeWM* hw) {
+    Listener *l, **tl;
+    for(int i = 0; i < onLast; i++) {
+      for(tl = &hw->listeners[i]; (l = *tl); ) {
+        if(l->removed) {
+          *tl = l->next;
+          freeListener(l);
+        } else {
+          tl = &l->next;
+        }
+      }
+    }
+    hw->listeners_removed = False;
+  }
+
+  static void freeListener(Listener *l) {
+    l->callback.Dispose();
+    l->callback.Clear();
+    free(l->wm_class);
+    free(l);
+  }
+
+  static Bool HasListener(NodeWM* hw, int event) {
+    Listener *l;
+    for(l = hw->listeners[event]; l; l = l->next)
+      if(!l->removed)
+        return True;
+    return False;
+  }
+
+  static Bool Matches(NodeWM* hw, Listener *l, EventInfo *info) {
+    if(l->removed)
+      return False;
+    if(!info)
+      return True;
+    if(l->id && (!info->c || info->c->id != l->id))
+      return False;
+    if(l->buttons && (info->button >= 32 || !(l->buttons & (1 << info->button))))
+      return False;
+    if(l->modifiers != -1 && (int)CLEANMASK(info->state) != l->modifiers)
+      return False;
+    if(l->keysym && l->keysym != info->keysym)
+      return False;
+    if(l->wm_class) {
+      Client *c = info->c;
+      if(!c)
+        return False;
+      if(!c->class_fetched) {
+        if(!hw->be->fetchClass(c->win, c->wm_class, sizeof(c->wm_class)))
+          c->wm_class[0] = '\0';
+        c->class_fetched = True;
+      }
+      if(strcmp(c->wm_class, l->wm_class))
+        return False;
+    }
+    return True;
+  }
+
+  /**
+   * Whether any listener wants the event. Call before building the
+   * arguments; events nobody wants are only counted.
+   */
+  Bool Wants(callback_map event, EventInfo *info) {
+    Listener *l;
+    for(l = this->listeners[event]; l; l = l->next)
+      if(Matches(this, l, info))
+        return True;
+    this->emit_filtered[event]++;
+    return False;
+  }
+
+  void Emit(callback_map event, EventInfo *info, int argc, Handle<Value> argv[]) {
     TryCatch try_catch;
-    if(this->callbacks[event] != NULL) {
-      Handle<Function> *callback = cb_unwrap(this->callbacks[event]);
-      (*callback)->Call(Context::GetCurrent()->Global(), argc, argv);                
+    Listener *l;
+    this->emitting++;
+    for(l = this->listeners[event]; l; l = l->next) {
+      if(!Matches(this, l, info))
+        continue;
+      this->emit_calls[event]++;
+      l->callback->Call(Context::GetCurrent()->Global(), argc, argv);
       if (try_catch.HasCaught()) {
         FatalException(try_catch);
+        try_catch.Reset();
+      }
+    }
+    if(--this->emitting == 0 && this->listeners_removed) {
+      SweepListeners(this);
+    }
+  }
+
+  /**
+   * Listener calls and filtered events, per event:
+   * { add: { listeners, calls, filtered }, ... }
+   */
+  static Handle<Value> Stats(const Arguments& args) {
+    HandleScope scope;
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    Local<Object> result = Object::New();
+    for(int i = 0; i < onLast; i++) {
+      Local<Object> event = Object::New();
+      Listener *l;
+      int n = 0;
+      for(l = hw->listeners[i]; l; l = l->next)
+        if(!l->removed)
+          n++;
+      event->Set(String::NewSymbol("listeners"), Integer::New(n));
+      event->Set(String::NewSymbol("calls"), Number::New(hw->emit_calls[i]));
+      event->Set(String::NewSymbol("filtered"), Number::New(hw->emit_filtered[i]));
+      result->Set(String::NewSymbol(callback_names[i]), event);
+    }
+    return scope.Close(result);
+  }
+
+  /**
+   * The X events we ask for depend on which listeners exist, so that
+   * features nobody listens to generate no X traffic at all:
+   *
+   * - root: SubstructureRedirect (MapRequest). Clicks on the root itself
+   *   are not selected, buttonPress is only about windows, which the
+   *   button grabs cover.
+   * - clients: StructureNotify (UnmapNotify, DestroyNotify) always, for the
+   *   client list; EnterWindow for enterNotify; PropertyChange if there is
+   *   a bar, for window titles.
+   * - button grabs on clients (click to focus) for buttonPress.
+   * - key grabs on the root for keyPress.
+   */
+  static long RootEventMask(NodeWM* hw) {
+    return SubstructureRedirectMask;
+  }
+
+  static long ClientEventMask(NodeWM* hw) {
+    long mask = StructureNotifyMask;
+    if(HasListener(hw, onEnterNotify))
+      mask |= EnterWindowMask;
+    if(WantsNames(hw))
+      mask |= PropertyChangeMask;
+    return mask;
+  }
+
+  // window titles are shown on the bar and listed on the control socket
+  static Bool WantsNames(NodeWM* hw) {
+    return hw->bar_font || hw->control_fd != -1;
+  }
+
+  /**
+   * Reselect input on the root and all clients after listeners changed.
+   * Nothing is sent if the masks stay the same.
+   */
+  static void UpdateEventMasks(NodeWM* hw) {
+    Monitor *m;
+    Client *c;
+    if(!hw->be) {
+      // not set up yet, Setup calls us
+      return;
+    }
+    long root_mask = RootEventMask(hw);
+    long client_mask = ClientEventMask(hw);
+    Bool grab_buttons = HasListener(hw, onMouseDown);
+    Bool grab_keys = HasListener(hw, onKeyPress);
+
+    if(root_mask != hw->root_mask) {
+      hw->be->selectInput(hw->root, root_mask);
+      hw->root_mask = root_mask;
+    }
+    if(grab_keys != hw->grab_keys) {
+      hw->grab_keys = grab_keys;
+      if(grab_keys)
+        GrabKeys(hw);
+      else
+        hw->be->ungrabKeys(hw->root);
+    }
+    if(client_mask != hw->client_mask || grab_buttons != hw->grab_buttons) {
+      Bool regrab = (grab_buttons != hw->grab_buttons);
+      Bool reselect = (client_mask != hw->client_mask);
+      hw->client_mask = client_mask;
+      hw->grab_buttons = grab_buttons;
+      for(m = hw->mons; m; m = m->next) {
+        for(c = m->clients; c; c = c->next) {
+          if(reselect)
+            hw->be->selectInput(c->win, client_mask);
+          if(regrab)
+            GrabButtons(hw, c->win, (c == hw->monit->sel));
+        }
       }
     }
+    hw->be->flush();
   }
 
   // Client management
@@ -211,6 +757,17 @@ public:
     *tc = c->next;    
   }
 
+  static void attachstack(Client *c) {
+    c->snext = c->mon->stack;
+    c->mon->stack = c;
+  }
+
+  static void detachstack(Client *c) {
+    Client **tc;
+    for(tc = &c->mon->stack; *tc && *tc != c; tc = &(*tc)->snext);
+    *tc = c->snext;
+  }
+
   static Client* createClient(Window win, Monitor* monitor, int id, int x, int y, int width, int height) {
     Client *c;
     if(!(c = (Client *)calloc(1, sizeof(Client)))) {
@@ -227,41 +784,227 @@ public:
     return c;
   }
 
-  static Monitor* createMonitor(void) {
+  static Monitor* createMonitor(NodeWM* hw) {
     Monitor *m;
     if(!(m = (Monitor *)calloc(1, sizeof(Monitor)))) {
       fprintf( stderr, "fatal: could not malloc() %lu bytes\n", sizeof(Monitor));
       exit( -1 );            
     }
-   fprintf( stderr, "Create monitor\n");
+    m->id = hw->next_monitor++;
+    debug("Create monitor %d\n", m->id);
     return m;    
   }
 
   static Client* getByWindow(NodeWM* hw, Window win) {
     Client *c;
-//    Monitor *m;
-    for(c = hw->monit->clients; c; c = c->next)
-      if(c->win == win)
-        return c;
+    Monitor *m;
+    for(m = hw->mons; m; m = m->next)
+      for(c = m->clients; c; c = c->next)
+        if(c->win == win)
+          return c;
     return NULL;
   }
 
   static Client* getById(NodeWM* hw, int id) {
     Client *c;
-    for(c = hw->monit->clients; c; c = c->next)
-      if(c->id == id)
-        return c;
+    Monitor *m;
+    for(m = hw->mons; m; m = m->next)
+      for(c = m->clients; c; c = c->next)
+        if(c->id == id)
+          return c;
     return NULL;  
   }
 
-  static void updateGeometry(NodeWM* hw) {
-    if(!hw->monit)
-      hw->monit = createMonitor();
-    if(hw->monit->width != hw->screen_width || hw->monit->height != hw->screen_width){
-      hw->monit->width = hw->screen_width;
-      hw->monit->height = hw->screen_height;
+  static Monitor* monitorAt(NodeWM* hw, int x, int y) {
+    Monitor *m;
+    for(m = hw->mons; m; m = m->next)
+      if(x >= m->x && x < m->x + m->width && y >= m->y && y < m->y + m->height)
+        return m;
+    return hw->monit;
+  }
+
+  /**
+   * Match the monitors to the current heads: a monitor keeps a head with
+   * the same geometry, the remaining heads go to the remaining monitors (in
+   * order) and are flagged as changed, or get new monitors. The clients of
+   * monitors left without a head move to the first monitor, which is
+   * flagged too. Nothing is sent for the clients of the other monitors, so
+   * the cost depends on what changed, not on the number of clients.
+   * Returns True if anything changed; the ids of the removed monitors and
+   * the moved clients are added to removed and moved.
+   */
+  static Bool updateGeometry(NodeWM* hw, Local<Array> removed, Local<Array> moved) {
+    XRectangle heads[MAXHEADS], unique[MAXHEADS];
+    Monitor *assigned[MAXHEADS], *m, *next, *first;
+    int i, j, n, nunique = 0;
+    Client *c;
+    Bool changed = False;
+
+    n = hw->be->queryScreens(heads, MAXHEADS);
+    // cloned outputs show up as identical heads
+    for(i = 0; i < n; i++) {
+      for(j = 0; j < nunique; j++)
+        if(sameGeometry(&unique[j], &heads[i]))
+          break;
+      if(j == nunique)
+        unique[nunique++] = heads[i];
+    }
+    if(nunique == 0) {
+      unique[0].x = unique[0].y = 0;
+      unique[0].width = hw->screen_width;
+      unique[0].height = hw->screen_height;
+      nunique = 1;
+    }
+
+    // unchanged heads first
+    for(m = hw->mons; m; m = m->next)
+      m->changed = False;
+    for(i = 0; i < nunique; i++) {
+      assigned[i] = NULL;
+      for(m = hw->mons; m && !assigned[i]; m = m->next)
+        if(m->width && sameMonitor(m, &unique[i]) && !isAssigned(m, assigned, i))
+          assigned[i] = m;
+    }
+    // then the rest, in order
+    for(i = 0; i < nunique; i++) {
+      if(assigned[i])
+        continue;
+      for(m = hw->mons; m && isAssigned(m, assigned, nunique); m = m->next);
+      if(!m)
+        m = createMonitor(hw);
+      assigned[i] = m;
+      m->x = unique[i].x;
+      m->y = unique[i].y;
+      m->width = unique[i].width;
+      m->height = unique[i].height;
+      m->changed = True;
+      changed = True;
+      if(m->bar) {
+        StackForget(hw, m->barwin);
+        bar_destroy(m->bar, hw->be);
+        m->bar = NULL;
+        m->barwin = None;
+      }
+    }
+
+    // monitors without a head give their clients to the first one
+    first = assigned[0];
+    for(m = hw->mons; m; m = next) {
+      next = m->next;
+      if(isAssigned(m, assigned, nunique))
+        continue;
+      removed->Set(removed->Length(), Integer::New(m->id));
+      while((c = m->clients)) {
+        detach(c);
+        detachstack(c);
+        c->mon = first;
+        attach(c);
+        attachstack(c);
+        moved->Set(moved->Length(), Integer::New(c->id));
+      }
+      first->changed = True;
+      if(hw->monit == m) {
+        hw->monit = first;
+        first->sel = m->sel;
+      }
+      if(m->bar) {
+        StackForget(hw, m->barwin);
+        bar_destroy(m->bar, hw->be);
+      }
+      free(m);
+      hw->stack_dirty = True;
+      changed = True;
+    }
+
+    // the monitor list follows the order of the heads
+    hw->mons = first;
+    for(i = 0; i < nunique; i++) {
+      assigned[i]->next = (i + 1 < nunique ? assigned[i + 1] : NULL);
+      SetupBar(hw, assigned[i]);
     }
-    return;
+    if(!hw->monit)
+      hw->monit = first;
+    return changed;
+  }
+
+  static Bool sameGeometry(XRectangle *a, XRectangle *b) {
+    return a->x == b->x && a->y == b->y && a->width == b->width && a->height == b->height;
+  }
+
+  static Bool sameMonitor(Monitor *m, XRectangle *r) {
+    return m->x == r->x && m->y == r->y && m->width == r->width && m->height == r->height;
+  }
+
+  static Bool isAssigned(Monitor *m, Monitor **assigned, int n) {
+    for(int i = 0; i < n; i++)
+      if(assigned[i] == m)
+        return True;
+    return False;
+  }
+
+  static void SetupBar(NodeWM* hw, Monitor *m) {
+    if(!hw->bar_font || m->bar)
+      return;
+    if(!(m->bar = bar_create(hw->be, m->x, m->y, m->width, m->height, hw->bar_font)))
+      return;
+    m->barwin = m->bar->win;
+    StackMapped(hw, m->barwin);
+    bar_set_text(m->bar, hw->be, BarWorkspaces, hw->bar_text[BarWorkspaces], False);
+    bar_set_text(m->bar, hw->be, BarStatus, hw->bar_text[BarStatus], False);
+    hw->stack_dirty = True;
+  }
+
+  static Local<Object> makeMonitor(Monitor *m) {
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("id"), Integer::New(m->id));
+    result->Set(String::NewSymbol("x"), Integer::New(m->x));
+    result->Set(String::NewSymbol("y"), Integer::New(m->y));
+    result->Set(String::NewSymbol("width"), Integer::New(m->width));
+    // the bar is not for windows
+    result->Set(String::NewSymbol("height"), Integer::New(m->height - (m->bar ? m->bar->h : 0)));
+    result->Set(String::NewSymbol("changed"), Boolean::New(m->changed));
+    return result;
+  }
+
+  /**
+   * The screen: width, height (without the bar of the first monitor), and
+   * monitors.
+   */
+  static Local<Object> makeScreen(NodeWM* hw) {
+    Local<Object> result = Object::New();
+    Local<Array> monitors = Array::New();
+    Monitor *m;
+    int i = 0;
+    for(m = hw->mons; m; m = m->next)
+      monitors->Set(i++, makeMonitor(m));
+    result->Set(String::NewSymbol("width"), Integer::New(hw->screen_width));
+    result->Set(String::NewSymbol("height"), Integer::New(hw->screen_height
+                                                          - (hw->mons->bar ? hw->mons->bar->h : 0)));
+    result->Set(String::NewSymbol("monitors"), monitors);
+    return result;
+  }
+
+  /**
+   * RandR told us the screen changed. Called at Commit, so a burst of
+   * notifications costs one query, and JS gets one screenChange event:
+   * the screen plus the removed monitors and the moved clients. Scripts
+   * only need to lay out the monitors flagged as changed.
+   */
+  static void ScreenChange(NodeWM* hw) {
+    HandleScope scope;
+    Local<Array> removed = Array::New();
+    Local<Array> moved = Array::New();
+    Local<Value> argv[1];
+    hw->screen_dirty = False;
+    hw->screen_width = hw->be->displayWidth();
+    hw->screen_height = hw->be->displayHeight();
+    if(!updateGeometry(hw, removed, moved) || !hw->Wants(onScreenChange, NULL))
+      return;
+    Local<Object> screen = makeScreen(hw);
+    screen->Set(String::NewSymbol("removed"), removed);
+    screen->Set(String::NewSymbol("moved"), moved);
+    argv[0] = screen;
+    hw->Emit(onScreenChange, NULL, 1, argv);
   }
 
   /**
@@ -272,44 +1015,76 @@ public:
     // onManage receives a window object
     Local<Value> argv[1];
     // temporarily store window to hw->wnd
-    Client* c = createClient(win, hw->monit, hw->next_index, wa->x, wa->y, wa->height, wa->width);
+    Client* c = createClient(win, monitorAt(hw, wa->x, wa->y), hw->next_index, wa->x, wa->y, wa->width, wa->height);
     attach(c);
-    argv[0] = NodeWM::makeWindow(hw->next_index, wa->x, wa->y, wa->height, wa->width, wa->border_width);
+    // the server maps new windows on top, which is also the top of the
+    // client stack; only the bars have to go back above it
+    attachstack(c);
+    StackMapped(hw, win);
+    if(hw->bar_font)
+      hw->stack_dirty = True;
+    if(!hw->be->getTransientForHint(win, &c->transient_for)) {
+      c->transient_for = None;
+    }
+    if(WantsNames(hw)) {
+      hw->be->fetchName(win, c->name, sizeof(c->name));
+    }
+    // only costs the property reads while a spawned window is pending
+    Launch *l = (hw->launches ? FindLaunch(hw, win) : NULL);
     hw->next_index++;
+    ControlEvent(hw, ControlAdd, "add", c->id);
 
     // call the callback in Node.js, passing the window object...
-    hw->Emit(onAdd, 1, argv);
-      
-    // configure the window
+    EventInfo info = { c, 0, 0, NoSymbol };
+    if(hw->Wants(onAdd, &info)) {
+      Local<Object> window = NodeWM::makeWindow(c->id, wa->x, wa->y, wa->height, wa->width, wa->border_width, c->mon->id);
+      if(l) {
+        window->Set(String::NewSymbol("pid"), Integer::New(l->pid));
+        window->Set(String::NewSymbol("workspace"), l->workspace);
+        window->Set(String::NewSymbol("launch_ms"), Number::New((ev_time() - l->started) * 1000));
+      }
+      argv[0] = window;
+      hw->Emit(onAdd, &info, 1, argv);
+    }
+
+    // lay out before the window is mapped, so it appears where it belongs
+    if(hw->Wants(onRearrange, NULL))
+      hw->Emit(onRearrange, NULL, 0, 0);
+
+    // configure the window; moves and resizes JS made so far are used here
+    // instead of waiting for Commit
     XConfigureEvent ce;
 
     ce.type = ConfigureNotify;
-    ce.display = hw->dpy;
+    ce.display = NULL;
     ce.event = win;
     ce.window = win;
-    ce.x = wa->x;
-    ce.y = wa->y;
-    ce.width = wa->width;
-    ce.height = wa->height;
+    ce.x = c->x;
+    ce.y = c->y;
+    ce.width = c->width;
+    ce.height = c->height;
     ce.border_width = wa->border_width;
     ce.above = None;
     ce.override_redirect = False;
 
-    (void) fprintf( stderr, "manage: x=%d y=%d width=%d height=%d \n", ce.x, ce.y, ce.width, ce.height);
+    debug("manage: x=%d y=%d width=%d height=%d \n", ce.x, ce.y, ce.width, ce.height);
 
-    XSendEvent(hw->dpy, win, False, StructureNotifyMask, (XEvent *)&ce);
+    hw->be->sendEvent(win, StructureNotifyMask, (XEvent *)&ce);
 
   
     // subscribe to window events
-    XSelectInput(hw->dpy, win, EnterWindowMask|FocusChangeMask|PropertyChangeMask|StructureNotifyMask);
-    GrabButtons(hw->dpy, win, False);
+    hw->be->selectInput(win, hw->client_mask);
+    if(hw->grab_buttons)
+      GrabButtons(hw, win, False);
 
     // move and (finally) map the window
-    XMoveResizeWindow(hw->dpy, win, ce.x, ce.y, ce.width, ce.height);    
-    XMapWindow(hw->dpy, win);
+    unmarkDirty(hw, c);
+    hw->be->moveResizeWindow(win, ce.x, ce.y, ce.width, ce.height);
+    hw->be->mapWindow(win);
+    hw->layout_moved = True;
 
-    // emit a rearrange
-    hw->Emit(onRearrange, 0, 0);
+    if(l)
+      RetireLaunch(hw, l);
   }
 
   static Handle<Value> ResizeWindow(const Arguments& args) {
@@ -321,10 +1096,12 @@ public:
     int height = args[2]->IntegerValue();
 
     Client* c = getById(hw, id);
-    if(c && c->win) {
-      fprintf( stderr, "ResizeWindow: id=%d width=%d height=%d \n", id, width, height);    
-      XResizeWindow(hw->dpy, c->win, width, height);    
-      XFlush(hw->dpy);
+    // a relayout that leaves the window where it is sends nothing
+    if(c && c->win && (c->width != width || c->height != height)) {
+      debug("ResizeWindow: id=%d width=%d height=%d \n", id, width, height);    
+      c->width = width;
+      c->height = height;
+      markDirty(hw, c, DirtySize);
     }
     return Undefined();
   } 
@@ -338,197 +1115,415 @@ public:
     int y = args[2]->IntegerValue();
 
     Client* c = getById(hw, id);
-    if(c && c->win) {
-      fprintf( stderr, "MoveWindow: id=%d x=%d y=%d \n", id, x, y);    
-      XMoveWindow(hw->dpy, c->win, x, y);    
-      XFlush(hw->dpy);
+    if(c && c->win && (c->x != x || c->y != y)) {
+      debug("MoveWindow: id=%d x=%d y=%d \n", id, x, y);    
+      c->x = x;
+      c->y = y;
+      markDirty(hw, c, DirtyPosition);
     }
     return Undefined();
   }
 
-  static Handle<Value> FocusWindow(const Arguments& args) {
+  /**
+   * Bar text, drawn at the end of the loop iteration if it changed
+   */
+  static Handle<Value> SetWorkspaces(const Arguments& args) {
     HandleScope scope;
     NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    SetBarText(hw, BarWorkspaces, *String::Utf8Value(args[0]));
+    return Undefined();
+  }
 
-    int id = args[0]->IntegerValue();
-    RealFocus(hw, id);
+  static Handle<Value> SetStatus(const Arguments& args) {
+    HandleScope scope;
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    SetBarText(hw, BarStatus, *String::Utf8Value(args[0]));
     return Undefined();
   }
 
-  static void RealFocus(NodeWM* hw, int id) {
-    Window win;
-    Client* c = getById(hw, id);
-    if(c && c->win) {
-      win = c->win;
-    } else {
-      win = hw->root;
-    }
-    fprintf( stderr, "FocusWindow: id=%d\n", id);    
-    // do not focus on the same window... it'll cause a flurry of events...
-    if(hw->selected && hw->selected != win) {
-      GrabButtons(hw->dpy, win, True);
-      XSetInputFocus(hw->dpy, win, RevertToPointerRoot, CurrentTime);    
-      Atom atom = XInternAtom(hw->dpy, "WM_TAKE_FOCUS", False);
-      SendEvent(hw, win, atom);
-      XFlush(hw->dpy);      
-      hw->selected = win;
-    }
+  static void SetBarText(NodeWM* hw, int segment, const char *text) {
+    Monitor *m;
+    strncpy(hw->bar_text[segment], text, BAR_TEXT - 1);
+    for(m = hw->mons; m; m = m->next)
+      if(m->bar)
+        bar_set_text(m->bar, hw->be, segment, text, False);
   }
 
-  static Bool SendEvent(NodeWM* hw, Window wnd, Atom proto) {
-    int n;
-    Atom *protocols;
-    Bool exists = False;
-    XEvent ev;
+  static Handle<Value> FocusWindow(const Arguments& args) {
+    HandleScope scope;
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
 
-    if(XGetWMProtocols(hw->dpy, wnd, &protocols, &n)) {
-      while(!exists && n--)
-        exists = protocols[n] == proto;
-      XFree(protocols);
-    }
-    if(exists) {
-      ev.type = ClientMessage;
-      ev.xclient.window = wnd;
-      Atom atom = XInternAtom(hw->dpy, "WM_PROTOCOLS", False);
-      ev.xclient.message_type = atom;
-      ev.xclient.format = 32;
-      ev.xclient.data.l[0] = proto;
-      ev.xclient.data.l[1] = CurrentTime;
-      XSendEvent(hw->dpy, wnd, False, NoEventMask, &ev);
-    }
-    return exists;    
+    int id = args[0]->IntegerValue();
+    RealFocus(hw, id);
+    return Undefined();
   }
 
   /**
-   * If focused, then we only grab the modifier keys.
-   * Otherwise, we grab all buttons..
+   * Stacking. raise/lower/setStack only reorder Monitor::stack; Commit sends
+   * the final order in a single RestackWindows request, so raising on every
+   * EnterNotify costs one request per loop iteration at most, and nothing
+   * if the window is already on top.
    */
-  static void GrabButtons(Display* dpy, Window wnd, Bool focused) {
-    XUngrabButton(dpy, AnyButton, AnyModifier, wnd);
-    if(focused) {
-      XGrabButton(dpy, Button3,
-                        Mod4Mask,
-                        wnd, False, (ButtonPressMask|ButtonReleaseMask),
-                        GrabModeAsync, GrabModeSync, None, None);
-    } else {
-      XGrabButton(dpy, AnyButton, AnyModifier, wnd, False,
-                  (ButtonPressMask|ButtonReleaseMask), GrabModeAsync, GrabModeSync, None, None);
+  static Handle<Value> Raise(const Arguments& args) {
+    HandleScope scope;
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    Client* c = getById(hw, args[0]->IntegerValue());
+    if(c) {
+      StackRaise(hw, c);
+    }
+    return Undefined();
+  }
+
+  static Handle<Value> Lower(const Arguments& args) {
+    HandleScope scope;
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    Client* c = getById(hw, args[0]->IntegerValue());
+    if(c) {
+      StackLower(hw, c);
     }
+    return Undefined();
   }
 
   /**
-   * Set the keys to grab
+   * setStack([ids]): the given windows on top, first id topmost; the others
+   * keep their order below them.
    */
-  static Handle<Value> GrabKeys(const Arguments& args) {
+  static Handle<Value> SetStack(const Arguments& args) {
     HandleScope scope;
-    int i;
-    Key k;
-    v8::Handle<v8::Value> val;
-    // extract from args.this
     NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
-    v8::Local<v8::Object> obj = Local<v8::Object>::Cast(args[0]);
-
-    for(i = 0; i < obj.length; i++) {
-      val = obj->Get(String::NewSymbol("key"));    
-      k.keysym = val->IntegerValue();
-      val = obj->Get(String::NewSymbol("modifier"));
-      k.mod = val->IntegerValue();
-      hw->keys[i] = k;
+    if(!args[0]->IsArray()) {
+      return Undefined();
+    }
+    Local<Array> ids = Local<Array>::Cast(args[0]);
+    for(int i = ids->Length() - 1; i >= 0; i--) {
+      Client* c = getById(hw, ids->Get(i)->IntegerValue());
+      if(c && c->mon->stack != c) {
+        detachstack(c);
+        attachstack(c);
+        hw->stack_dirty = True;
+      }
     }
     return Undefined();
   }
 
-  static void GrabKeys(Display* dpy, Window root) {
-    XUngrabKey(dpy, AnyKey, AnyModifier, root);
+  static void StackLower(NodeWM* hw, Client *c) {
+    Client **tc;
+    if(!c->snext)
+      return;
+    detachstack(c);
+    for(tc = &c->mon->stack; *tc; tc = &(*tc)->snext);
+    *tc = c;
+    c->snext = NULL;
+    hw->stack_dirty = True;
+  }
 
-    for(int i = 0; i < hw->keys.length; i++) {
-      XGrabKey(dpy, XKeysymToKeycode(dpy, keys[i].keysym), keys[i].mod, root, True, GrabModeAsync, GrabModeAsync);
+  static void StackRaise(NodeWM* hw, Client *c) {
+    Client *t, *tnext;
+    if(c->mon->stack != c) {
+      detachstack(c);
+      attachstack(c);
+      hw->stack_dirty = True;
+    }
+    // its dialogs go back above it
+    for(t = c->snext; t; t = tnext) {
+      tnext = t->snext;
+      if(t->transient_for == c->win) {
+        detachstack(t);
+        attachstack(t);
+        hw->stack_dirty = True;
+      }
     }
+  }
 
-    /*
-    // Valid keymap bits are: ShiftMask, LockMask, ControlMask, Mod1Mask, Mod2Mask, Mod3Mask, Mod4Mask, and Mod5Mask
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_1), Mod4Mask|ControlMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_2), Mod4Mask|ControlMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_3), Mod4Mask|ControlMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_4), Mod4Mask|ControlMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_5), Mod4Mask|ControlMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_6), Mod4Mask|ControlMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_7), Mod4Mask|ControlMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_8), Mod4Mask|ControlMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_9), Mod4Mask|ControlMask, root, True, GrabModeAsync, GrabModeAsync);
+  /**
+   * Request focus for a window (or the root, for an unknown id). Only the last
+   * request made during a loop iteration is committed, see Commit.
+   */
+  static void RealFocus(NodeWM* hw, int id) {
+    debug("FocusWindow: id=%d\n", id);    
+    hw->focus_next = getById(hw, id);
+    hw->focus_dirty = True;
+  }
 
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_1), Mod4Mask|ControlMask|ShiftMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_2), Mod4Mask|ControlMask|ShiftMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_3), Mod4Mask|ControlMask|ShiftMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_4), Mod4Mask|ControlMask|ShiftMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_5), Mod4Mask|ControlMask|ShiftMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_6), Mod4Mask|ControlMask|ShiftMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_7), Mod4Mask|ControlMask|ShiftMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_8), Mod4Mask|ControlMask|ShiftMask, root, True, GrabModeAsync, GrabModeAsync);
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_9), Mod4Mask|ControlMask|ShiftMask, root, True, GrabModeAsync, GrabModeAsync);
+  // COMMIT
 
-    XGrabKey(dpy, XKeysymToKeycode(dpy, XK_Return), Mod4Mask|ControlMask, root, True, GrabModeAsync, GrabModeAsync);
-    */
+  static void markDirty(NodeWM* hw, Client *c, unsigned int what) {
+    if(!c->dirty) {
+      c->dnext = hw->dirty;
+      hw->dirty = c;
+    }
+    c->dirty |= what;
   }
 
-  static Local<Object> makeWindow(int id, int x, int y, int height, int width, int border_width) {
-    // window object to return
-    Local<Object> result = Object::New();
-
-    // read and set the window geometry
-    result->Set(String::NewSymbol("id"), Integer::New(id));
-    result->Set(String::NewSymbol("x"), Integer::New(x));
-    result->Set(String::NewSymbol("y"), Integer::New(y));
-    result->Set(String::NewSymbol("height"), Integer::New(height));
-    result->Set(String::NewSymbol("width"), Integer::New(width));
-    result->Set(String::NewSymbol("border_width"), Integer::New(border_width));
-    // read and set the monitor (not important)
-//    result->Set(String::NewSymbol("monitor"), Integer::New(hw->selected_monitor));
-    return result;
+  static void unmarkDirty(NodeWM* hw, Client *c) {
+    Client **tc;
+    if(!c->dirty)
+      return;
+    for(tc = &hw->dirty; *tc && *tc != c; tc = &(*tc)->dnext);
+    *tc = c->dnext;
+    c->dirty = 0;
   }
 
-  static void EmitButtonPress(NodeWM* hw, XEvent *e) {
+  /**
+   * Send everything JS changed during this loop iteration, merged per window
+   * (any number of moveWindow/resizeWindow calls for a window become one
+   * ConfigureWindow request with the final geometry), then flush once.
+   * Called from the ev_prepare watcher just before the loop blocks, so
+   * scripts get batching without doing anything.
+   */
+  static void Commit(NodeWM* hw) {
+    Client *c, *next;
+    Monitor *m;
+    if(hw->screen_dirty) {
+      ScreenChange(hw);
+    }
+    for(c = hw->dirty; c; c = next) {
+      next = c->dnext;
+      if((c->dirty & DirtyPosition) && (c->dirty & DirtySize)) {
+        hw->be->moveResizeWindow(c->win, c->x, c->y, c->width, c->height);
+      } else if(c->dirty & DirtyPosition) {
+        hw->be->moveWindow(c->win, c->x, c->y);
+      } else {
+        hw->be->resizeWindow(c->win, c->width, c->height);
+      }
+      c->dirty = 0;
+      c->dnext = NULL;
+      hw->layout_moved = True;
+    }
+    hw->dirty = NULL;
+    if(hw->stack_dirty) {
+      CommitStack(hw);
+    }
+    CommitFocus(hw);
+    for(m = hw->mons; m; m = m->next) {
+      if(m->bar) {
+        bar_set_text(m->bar, hw->be, BarTitle, (m->sel ? m->sel->name : ""), (m->sel && m == hw->monit));
+        bar_draw(m->bar, hw->be);
+      }
+    }
+    if(hw->layout_moved) {
+      hw->layout_serial = hw->be->fence();
+      hw->layout_moved = False;
+    }
+    hw->be->flush();
+    // control socket replies go out after the requests they caused
+    ControlFlush(hw);
+  }
+
+  static void CommitStack(NodeWM* hw) {
+    Monitor *m;
+    Client *c;
+    int i, j, n = 0;
+    // room for a bar and the clients of each monitor
+    for(m = hw->mons; m; m = m->next) {
+      n++;
+      for(c = m->stack; c; c = c->snext)
+        n++;
+    }
+    reserveWindows(&hw->stack_buf, &hw->stack_size, n);
+    n = 0;
+    // the bars stay above the clients
+    for(m = hw->mons; m; m = m->next)
+      if(m->barwin)
+        hw->stack_buf[n++] = m->barwin;
+    for(m = hw->mons; m; m = m->next)
+      for(c = m->stack; c; c = c->snext)
+        hw->stack_buf[n++] = c->win;
+    // the bottom part that is in order on the server already stays put;
+    // RestackWindows is a ConfigureWindow per window after the first
+    for(i = n - 1, j = hw->stack_last_n - 1; i >= 0 && j >= 0 && hw->stack_buf[i] == hw->stack_last[j]; i--, j--);
+    if(i >= 0) {
+      if(hw->stack_last_n == 0 || hw->stack_last[0] != hw->stack_buf[0])
+        hw->be->raiseWindow(hw->stack_buf[0]);
+      if(i > 0)
+        hw->be->restackWindows(hw->stack_buf, i + 1);
+      // crossing events caused by the restack are not the user's doing
+      hw->layout_moved = True;
+    }
+    reserveWindows(&hw->stack_last, &hw->stack_last_size, n);
+    memcpy(hw->stack_last, hw->stack_buf, n * sizeof(Window));
+    hw->stack_last_n = n;
+    hw->stack_dirty = False;
+  }
+
+  static void reserveWindows(Window **buf, int *size, int n) {
+    if(n <= *size)
+      return;
+    *size = n * 2;
+    if(!(*buf = (Window *)realloc(*buf, *size * sizeof(Window)))) {
+      fprintf( stderr, "fatal: could not malloc() %lu bytes\n", *size * sizeof(Window));
+      exit( -1 );
+    }
+  }
+
+  /**
+   * Keep stack_last in line with the server: mapped windows go on top,
+   * and destroyed or unmanaged ones are gone.
+   */
+  static void StackMapped(NodeWM* hw, Window win) {
+    reserveWindows(&hw->stack_last, &hw->stack_last_size, hw->stack_last_n + 1);
+    memmove(hw->stack_last + 1, hw->stack_last, hw->stack_last_n * sizeof(Window));
+    hw->stack_last[0] = win;
+    hw->stack_last_n++;
+  }
+
+  static void StackForget(NodeWM* hw, Window win) {
+    int i;
+    for(i = 0; i < hw->stack_last_n && hw->stack_last[i] != win; i++);
+    if(i == hw->stack_last_n)
+      return;
+    memmove(hw->stack_last + i, hw->stack_last + i + 1, (hw->stack_last_n - i - 1) * sizeof(Window));
+    hw->stack_last_n--;
+  }
+
+  static void CommitFocus(NodeWM* hw) {
+    Client *prev = hw->monit->sel;
+    Client *next = hw->focus_next;
+    if(!hw->focus_dirty) {
+      return;
+    }
+    hw->focus_dirty = False;
+    // do not focus on the same window... it'll cause a flurry of events...
+    if(prev == next) {
+      return;
+    }
+    // only the two windows whose state changed need their buttons regrabbed,
+    // and only if there are grabs at all
+    if(prev && hw->grab_buttons) {
+      GrabButtons(hw, prev->win, False);
+    }
+    if(next) {
+      if(hw->grab_buttons)
+        GrabButtons(hw, next->win, True);
+      hw->be->setInputFocus(next->win);
+      SendEvent(hw, next->win, hw->wm_take_focus);
+    } else {
+      hw->be->setInputFocus(hw->root);
+    }
+    if(next) {
+      hw->monit = next->mon;
+    }
+    hw->monit->sel = next;
+    ControlEvent(hw, ControlFocus, "focus", (next ? next->id : 0));
+  }
+
+  static Bool SendEvent(NodeWM* hw, Window wnd, Atom proto) {
+    int n;
+    Atom *protocols;
+    Bool exists = False;
+    XEvent ev;
+
+    if(hw->be->getWMProtocols(wnd, &protocols, &n)) {
+      while(!exists && n--)
+        exists = protocols[n] == proto;
+      hw->be->freeList(protocols);
+    }
+    if(exists) {
+      ev.type = ClientMessage;
+      ev.xclient.window = wnd;
+      ev.xclient.message_type = hw->wm_protocols;
+      ev.xclient.format = 32;
+      ev.xclient.data.l[0] = proto;
+      ev.xclient.data.l[1] = CurrentTime;
+      hw->be->sendEvent(wnd, NoEventMask, &ev);
+    }
+    return exists;    
+  }
+
+  /**
+   * If focused, then we only grab the modifier keys.
+   * Otherwise, we grab all buttons..
+   */
+  static void GrabButtons(NodeWM* hw, Window wnd, Bool focused) {
+    hw->be->ungrabButton(wnd);
+    if(!hw->grab_buttons) {
+      return;
+    }
+    if(focused) {
+      hw->be->grabButton(Button3, Mod4Mask, wnd);
+    } else {
+      hw->be->grabButton(AnyButton, AnyModifier, wnd);
+    }
+  }
+
+  /**
+   * Read the keys to grab from setup({ keys: [ { key: XK_..., modifier: ... } ] })
+   */
+  static void ReadKeys(NodeWM* hw, Handle<Value> value) {
+    if(!value->IsArray()) {
+      return;
+    }
+    Local<Array> arr = Local<Array>::Cast(value);
+    free(hw->keys);
+    hw->nkeys = arr->Length();
+    if(!(hw->keys = (Key *)calloc(hw->nkeys + 1, sizeof(Key)))) {
+      fprintf( stderr, "fatal: could not malloc() %lu bytes\n", (hw->nkeys + 1) * sizeof(Key));
+      exit( -1 );
+    }
+    for(int i = 0; i < hw->nkeys; i++) {
+      Local<Object> obj = arr->Get(i)->ToObject();
+      hw->keys[i].keysym = obj->Get(String::NewSymbol("key"))->IntegerValue();
+      hw->keys[i].mod = obj->Get(String::NewSymbol("modifier"))->IntegerValue();
+    }
+  }
+
+  static void GrabKeys(NodeWM* hw) {
+    hw->be->ungrabKeys(hw->root);
+    for(int i = 0; i < hw->nkeys; i++) {
+      hw->be->grabKey(hw->keys[i].keysym, hw->keys[i].mod, hw->root);
+    }
+  }
+
+  static Local<Object> makeWindow(int id, int x, int y, int height, int width, int border_width, int monitor) {
+    // window object to return
+    Local<Object> result = Object::New();
+
+    // read and set the window geometry
+    result->Set(String::NewSymbol("id"), Integer::New(id));
+    result->Set(String::NewSymbol("x"), Integer::New(x));
+    result->Set(String::NewSymbol("y"), Integer::New(y));
+    result->Set(String::NewSymbol("height"), Integer::New(height));
+    result->Set(String::NewSymbol("width"), Integer::New(width));
+    result->Set(String::NewSymbol("border_width"), Integer::New(border_width));
+    result->Set(String::NewSymbol("monitor"), Integer::New(monitor));
+    return result;
+  }
+
+  static void EmitButtonPress(NodeWM* hw, XEvent *e) {
     XButtonPressedEvent *ev = &e->xbutton;
     Local<Value> argv[1];
 
-    fprintf(stderr, "EmitButtonPress\n");
+    debug("EmitButtonPress\n");
 
     // fetch window: ev->window --> to window id
     // fetch root_x,root_y
     Client* c = getByWindow(hw, ev->window);
-    if(c) {
+    EventInfo info = { c, ev->button, ev->state, NoSymbol };
+    if(c && hw->Wants(onMouseDown, &info)) {
       int id = c->id;
       argv[0] = NodeWM::makeButtonPress(id, ev->x, ev->y, ev->button, ev->state);
-      fprintf(stderr, "makeButtonPress\n");
+      debug("makeButtonPress\n");
       // call the callback in Node.js, passing the window object...
-      hw->Emit(onMouseDown, 1, argv);
-      fprintf(stderr, "Call cbButtonPress\n");
+      hw->Emit(onMouseDown, &info, 1, argv);
+      debug("Call cbButtonPress\n");
     }
   }
 
-  Bool getrootptr(int *x, int *y) {
-    int di;
-    unsigned int dui;
-    Window dummy;
-
-    return XQueryPointer(dpy, root, &dummy, &dummy, x, y, &di, &di, &dui);
-  }
-
   static Handle<Value> GrabMouseRelease(const Arguments& args) {
+    HandleScope scope;
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
     XEvent ev;
     int x, y;
     Local<Value> argv[1];
 
-    if(XGrabPointer(dpy, root, False, 
-      ButtonPressMask|ButtonReleaseMask|PointerMotionMask, GrabModeAsync, 
-      GrabModeAsync, None, XCreateFontCursor(dpy, XC_fleur), CurrentTime) != GrabSuccess) {
+    if(!hw->be->grabPointer(hw->root, ButtonPressMask|ButtonReleaseMask|PointerMotionMask)) {
       return Undefined();
     }
-    if(!getrootptr(&x, &y)) {
+    if(!hw->be->queryPointer(hw->root, &x, &y)) {
       return Undefined();
     }
     do{
-      XMaskEvent(dpy, ButtonPressMask|ButtonReleaseMask|PointerMotionMask|ExposureMask|SubstructureRedirectMask, &ev);
+      hw->be->maskEvent(ButtonPressMask|ButtonReleaseMask|PointerMotionMask|ExposureMask|SubstructureRedirectMask, &ev);
       switch(ev.type) {
         case ConfigureRequest:
           // handle normally
@@ -541,14 +1536,18 @@ public:
           break;
         case MotionNotify:
           {          
-            argv[0] = NodeWM::makeMouseDrag(x, y, ev.xmotion.x, ev.xmotion.y, ev.state);
-            hw->Emit(onMouseDrag, 1, argv);
+            EventInfo info = { NULL, 0, ev.xmotion.state, NoSymbol };
+            if(hw->Wants(onMouseDrag, &info)) {
+              argv[0] = NodeWM::makeMouseDrag(x, y, ev.xmotion.x, ev.xmotion.y, ev.xmotion.state);
+              hw->Emit(onMouseDrag, &info, 1, argv);
+            }
           }
           break;
       }
     } while(ev.type != ButtonRelease);
 
-    XUngrabPointer(dpy, CurrentTime);
+    hw->be->ungrabPointer();
+    return Undefined();
   }
 
 
@@ -584,38 +1583,117 @@ public:
     XKeyEvent *ev;
 
     ev = &e->xkey;
-    keysym = XKeycodeToKeysym(hw->dpy, (KeyCode)ev->keycode, 0);
+    keysym = hw->be->keycodeToKeysym((KeyCode)ev->keycode);
     Local<Value> argv[1];
-    argv[0] = NodeWM::makeKeyPress(ev->x, ev->y, ev->keycode, keysym, ev->state);
+    // keys are grabbed on the root, the window they are for is the focused one
+    EventInfo info = { hw->monit->sel, 0, ev->state, keysym };
+    if(!hw->Wants(onKeyPress, &info)) {
+      return;
+    }
+    argv[0] = NodeWM::makeKeyPress(ev->x, ev->y, ev->keycode, keysym, keysymName(keysym), ev->state);
     // call the callback in Node.js, passing the window object...
-    hw->Emit(onKeyPress, 1, argv);
+    hw->Emit(onKeyPress, &info, 1, argv);
   }
 
-  static Local<Object> makeKeyPress(int x, int y, unsigned int keycode, KeySym keysym, unsigned int mod) {
+  static Local<Object> makeKeyPress(int x, int y, unsigned int keycode, KeySym keysym, const char *name, unsigned int mod) {
     // window object to return
     Local<Object> result = Object::New();
     // read and set the window geometry
     result->Set(String::NewSymbol("x"), Integer::New(x));
     result->Set(String::NewSymbol("y"), Integer::New(y));
     result->Set(String::NewSymbol("keysym"), Integer::New(keysym));
+    if(name) {
+      result->Set(String::NewSymbol("name"), String::NewSymbol(name));
+    }
     result->Set(String::NewSymbol("keycode"), Integer::New(keycode));
     result->Set(String::NewSymbol("mod"), Integer::New(mod));
     return result;
   }
 
+  /**
+   * Keysym names are looked up by binary search in the generated tables,
+   * a handful of comparisons whatever the size of keysymdef.js.
+   */
+  static const char* keysymName(KeySym keysym) {
+    int lo = 0, hi = KEYSYMS_BY_SYM - 1;
+    while(lo <= hi) {
+      int mid = (lo + hi) / 2;
+      if(keysyms_by_sym[mid].keysym == keysym)
+        return keysyms_by_sym[mid].name;
+      if(keysyms_by_sym[mid].keysym < keysym)
+        lo = mid + 1;
+      else
+        hi = mid - 1;
+    }
+    return NULL;
+  }
+
+  static KeySym keysymFromName(const char *name) {
+    int lo = 0, hi = KEYSYMS_BY_NAME - 1;
+    while(lo <= hi) {
+      int mid = (lo + hi) / 2;
+      int cmp = strcmp(keysyms_by_name[mid].name, name);
+      if(cmp == 0)
+        return keysyms_by_name[mid].keysym;
+      if(cmp < 0)
+        lo = mid + 1;
+      else
+        hi = mid - 1;
+    }
+    return NoSymbol;
+  }
+
+  static Handle<Value> KeysymToName(const Arguments& args) {
+    HandleScope scope;
+    const char *name = keysymName(args[0]->IntegerValue());
+    if(!name) {
+      return Undefined();
+    }
+    return scope.Close(String::NewSymbol(name));
+  }
+
+  static Handle<Value> KeysymFromName(const Arguments& args) {
+    HandleScope scope;
+    KeySym keysym = keysymFromName(*String::AsciiValue(args[0]));
+    if(keysym == NoSymbol) {
+      return Undefined();
+    }
+    return scope.Close(Integer::New(keysym));
+  }
+
   static void EmitEnterNotify(NodeWM* hw, XEvent *e) {
     XCrossingEvent *ev = &e->xcrossing;
     // onManage receives a window object
     Local<Value> argv[1];
 
-    fprintf(stderr, "EmitEnterNotify\n");
+    debug("EmitEnterNotify\n");
+
+    // the pointer did not move, a window moved under it because of our layout
+    if(ev->serial < hw->layout_serial) {
+      return;
+    }
 
     Client* c = getByWindow(hw, ev->window);
-    if(c) {
+    EventInfo info = { c, 0, ev->state, NoSymbol };
+    if(c && hw->Wants(onEnterNotify, &info)) {
       int id = c->id;
       argv[0] = NodeWM::makeEvent(id);
       // call the callback in Node.js, passing the window object...
-      hw->Emit(onEnterNotify, 1, argv);
+      hw->Emit(onEnterNotify, &info, 1, argv);
+    }
+  }
+
+  /**
+   * A managed window is on screen; for measuring how long programs take
+   * to show up.
+   */
+  static void EmitMapNotify(NodeWM* hw, XEvent *e) {
+    Local<Value> argv[1];
+    Client *c = getByWindow(hw, e->xmap.window);
+    EventInfo info = { c, 0, 0, NoSymbol };
+    if(c && hw->Wants(onMapNotify, &info)) {
+      argv[0] = NodeWM::makeEvent(c->id);
+      hw->Emit(onMapNotify, &info, 1, argv);
     }
   }
 
@@ -628,6 +1706,30 @@ public:
     }
   }
 
+  static void EmitExpose(NodeWM* hw, XEvent *e) {
+    XExposeEvent *ev = &e->xexpose;
+    Monitor *m;
+    // the pixmap has everything, no need to redraw
+    for(m = hw->mons; m && ev->count == 0; m = m->next) {
+      if(m->bar && ev->window == m->bar->win) {
+        bar_expose(m->bar, hw->be);
+        break;
+      }
+    }
+  }
+
+  static void EmitPropertyNotify(NodeWM* hw, XEvent *e) {
+    XPropertyEvent *ev = &e->xproperty;
+    Client *c;
+    // titles are only kept for the bar, which is redrawn at Commit, and the
+    // control socket
+    if(WantsNames(hw) && ev->atom == XA_WM_NAME && (c = getByWindow(hw, ev->window))) {
+      if(!hw->be->fetchName(c->win, c->name, sizeof(c->name))) {
+        c->name[0] = '\0';
+      }
+    }
+  }
+
   static void EmitUnmapNotify(NodeWM* hw, XEvent *e) {
     Client *c;
     XUnmapEvent *ev = &e->xunmap;
@@ -646,22 +1748,37 @@ public:
   static void EmitRemove(NodeWM* hw, Client *c, Bool destroyed) {
 //    Monitor *m = c->mon;
 //    XWindowChanges wc;
-    fprintf( stderr, "EmitRemove\n");
+    debug("EmitRemove\n");
     int id = c->id;
     // emit a remove
     Local<Value> argv[1];
-    argv[0] = Integer::New(id);
-    hw->Emit(onRemove, 1, argv);
+    EventInfo info = { c, 0, 0, NoSymbol };
+    if(hw->Wants(onRemove, &info)) {
+      argv[0] = Integer::New(id);
+      hw->Emit(onRemove, &info, 1, argv);
+    }
+    ControlEvent(hw, ControlRemove, "remove", id);
     detach(c);
+    detachstack(c);
+    StackForget(hw, c->win);
+    unmarkDirty(hw, c);
     if(!destroyed) {
-      XGrabServer(hw->dpy);
-      XUngrabButton(hw->dpy, AnyButton, AnyModifier, c->win);
-      XSync(hw->dpy, False);
-      XUngrabServer(hw->dpy);
+      hw->be->grabServer();
+      hw->be->ungrabButton(c->win);
+      hw->be->sync();
+      hw->be->ungrabServer();
+    }
+    // never leave a dangling pointer in the focus state; the server has
+    // already reverted the focus to the pointer root (RevertToPointerRoot)
+    if(c->mon->sel == c) {
+      c->mon->sel = NULL;
+    }
+    if(hw->focus_next == c) {
+      hw->focus_next = NULL;
     }
     free(c);
-    RealFocus(hw, -1);
-    hw->Emit(onRearrange, 0, 0);
+    if(hw->Wants(onRearrange, NULL))
+      hw->Emit(onRearrange, NULL, 0, 0);
   }
 
   static Local<Object> makeEvent(int id) {
@@ -676,43 +1793,68 @@ public:
     HandleScope scope;
     // extract from args.this
     NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    Local<Object> options = (args[0]->IsObject() ? args[0]->ToObject() : Object::New());
 
     // initialize resources
     // atoms
 
-    // open the display
-    if ( ( hw->dpy = XOpenDisplay(NIL) ) == NULL ) {
-      (void) fprintf( stderr, "cannot connect to X server %s\n", XDisplayName(NULL));
-      exit( -1 );
+    Local<Value> fake = options->Get(String::NewSymbol("fake"));
+    if(fake->IsObject()) {
+      // simulated display: { fake: { width: ..., height: ... } }
+      Local<Object> geom = fake->ToObject();
+      int width = geom->Get(String::NewSymbol("width"))->IntegerValue();
+      int height = geom->Get(String::NewSymbol("height"))->IntegerValue();
+      hw->fake = new FakeBackend((width > 0 ? width : 1024), (height > 0 ? height : 768));
+      hw->be = hw->fake;
+    } else {
+      // open the display and set error handler
+      if ( ( hw->be = XBackend::open(NIL, xerror) ) == NULL ) {
+        (void) fprintf( stderr, "cannot connect to X server %s\n", XDisplayName(NULL));
+        exit( -1 );
+      }
     }
-    // set error handler
-    XSetErrorHandler(xerror);
-    XSync(hw->dpy, False);
 
-    // take the default screen
-    hw->screen = DefaultScreen(hw->dpy);
     // get the root window
-    hw->root = RootWindow(hw->dpy, hw->screen);
+    hw->root = hw->be->rootWindow();
+    hw->wm_protocols = hw->be->internAtom("WM_PROTOCOLS");
+    hw->wm_take_focus = hw->be->internAtom("WM_TAKE_FOCUS");
+
+    // bar: true or { font: ... }, along the bottom of each monitor
+    Local<Value> bar = options->Get(String::NewSymbol("bar"));
+    if(bar->BooleanValue() && !hw->bar_font) {
+      Local<Value> font = (bar->IsObject() ? bar->ToObject()->Get(String::NewSymbol("font")) : Local<Value>());
+      hw->bar_font = strdup(!font.IsEmpty() && font->IsString() ? *String::Utf8Value(font) : "fixed");
+    }
 
-    // get screen geometry
-    hw->screen_width = DisplayWidth(hw->dpy, hw->screen);
-    hw->screen_height = DisplayHeight(hw->dpy, hw->screen);
-    // update monitor geometry (and create hw->monitor)
-    updateGeometry(hw);
+    // get screen geometry, and hear about changes to it
+    hw->screen_width = hw->be->displayWidth();
+    hw->screen_height = hw->be->displayHeight();
+    hw->rr_event = hw->be->screenChangeEvent();
+    // update monitor geometry (and create the monitors and their bars)
+    updateGeometry(hw, Array::New(), Array::New());
+    if(hw->bar_font && !hw->mons->bar) {
+      free(hw->bar_font);
+      hw->bar_font = NULL;
+    }
 
-    XSetWindowAttributes wa;
-    // subscribe to root window events e.g. SubstructureRedirectMask
-    wa.event_mask = SubstructureRedirectMask|SubstructureNotifyMask|ButtonPressMask
-                    |EnterWindowMask|LeaveWindowMask|StructureNotifyMask
-                    |PropertyChangeMask;
-    XSelectInput(hw->dpy, hw->root, wa.event_mask);
+    // control: path of a Unix socket to take commands on, see ControlCommand
+    Local<Value> control = options->Get(String::NewSymbol("control"));
+    if(control->IsString() && hw->control_fd == -1) {
+      String::Utf8Value path(control);
+      if((hw->control_fd = control_listen(*path)) != -1) {
+        hw->control_path = strdup(*path);
+        ev_io_init(&hw->control_watcher, EIO_ControlAccept, hw->control_fd, EV_READ);
+        hw->control_watcher.data = hw;
+        ev_io_start(EV_DEFAULT_ &hw->control_watcher);
+      }
+    }
 
-    GrabKeys(hw->dpy, hw->root);
+    // subscribe to root window events e.g. SubstructureRedirectMask,
+    // and grab keys and buttons, according to the listeners
+    ReadKeys(hw, options->Get(String::NewSymbol("keys")));
+    UpdateEventMasks(hw);
 
-    Local<Object> result = Object::New();
-    result->Set(String::NewSymbol("width"), Integer::New(hw->screen_width));
-    result->Set(String::NewSymbol("height"), Integer::New(hw->screen_height));
-    return scope.Close(result);
+    return scope.Close(makeScreen(hw));
   }
 
 
@@ -726,17 +1868,17 @@ public:
     NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
 
     unsigned int i, num;
-    Window d1, d2, *wins = NULL;
+    Window d1, *wins = NULL;
     XWindowAttributes wa;
     // XQueryTree() function returns the root ID, the parent window ID, a pointer to 
     // the list of children windows (NULL when there are no children), and 
     // the number of children in the list for the specified window. 
-    if(XQueryTree(hw->dpy, hw->root, &d1, &d2, &wins, &num)) {
+    if(hw->be->queryTree(hw->root, &wins, &num)) {
       for(i = 0; i < num; i++) {
         // if we can't read the window attributes, 
         // or the window is a popup (transient or override_redirect), skip it
-        if(!XGetWindowAttributes(hw->dpy, wins[i], &wa)
-        || wa.override_redirect || XGetTransientForHint(hw->dpy, wins[i], &d1)) {
+        if(!hw->be->getWindowAttributes(wins[i], &wa)
+        || wa.override_redirect || hw->be->getTransientForHint(wins[i], &d1)) {
           continue;          
         }
         // visible or minimized window ("Iconic state")
@@ -744,17 +1886,20 @@ public:
           NodeWM::EmitAdd(hw, wins[i], &wa);
       }
       for(i = 0; i < num; i++) { /* now the transients */
-        if(!XGetWindowAttributes(hw->dpy, wins[i], &wa))
+        if(!hw->be->getWindowAttributes(wins[i], &wa))
           continue;
-        if(XGetTransientForHint(hw->dpy, wins[i], &d1)
+        if(hw->be->getTransientForHint(wins[i], &d1)
         && (wa.map_state == IsViewable )) //|| getstate(wins[i]) == IconicState))
           NodeWM::EmitAdd(hw, wins[i], &wa);
       }
       if(wins) {
         // To free a non-NULL children list when it is no longer needed, use XFree()
-        XFree(wins);
+        hw->be->freeList(wins);
       }
     }
+    // these were mapped already, in an order we do not know
+    hw->stack_last_n = 0;
+    hw->stack_dirty = True;
 
     Local<String> result = String::New("Scan done");
     return scope.Close(result);
@@ -768,89 +1913,906 @@ public:
     // use ev_io
 
     // initiliaze and start 
-    ev_io_init(&hw->watcher, EIO_RealLoop, XConnectionNumber(hw->dpy), EV_READ);
+    ev_io_init(&hw->watcher, EIO_RealLoop, hw->be->connectionNumber(), EV_READ);
     hw->watcher.data = hw;
     ev_io_start(EV_DEFAULT_ &hw->watcher);
 
+    // commit before blocking, and pick up events Xlib read while we were
+    // not looking; these do not count as active, the ev_io does
+    ev_prepare_init(&hw->prepare, EIO_Prepare);
+    hw->prepare.data = hw;
+    ev_prepare_start(EV_DEFAULT_ &hw->prepare);
+    ev_unref(EV_DEFAULT_UC);
+    ev_check_init(&hw->check, EIO_Check);
+    hw->check.data = hw;
+    ev_check_start(EV_DEFAULT_ &hw->check);
+    ev_unref(EV_DEFAULT_UC);
+    ev_idle_init(&hw->idle, EIO_Idle);
+    hw->idle.data = hw;
+
 //    hw->Ref();
 
     return Undefined();
   }
 
+  /**
+   * Handle all pending events and commit the changes right now, without
+   * waiting for the event loop. Returns the number of events handled.
+   */
+  static Handle<Value> Dispatch(const Arguments& args) {
+    HandleScope scope;
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    int handled = HandleEvents(hw);
+    Commit(hw);
+    return scope.Close(Integer::New(handled));
+  }
+
   static void EIO_RealLoop(EV_P_ struct ev_io* watcher, int revents) {
+    NodeWM* hw = static_cast<NodeWM*>(watcher->data);
+    HandleEvents(hw);
+  }
 
-    NodeWM* hw = static_cast<NodeWM*>(watcher->data);    
-    
+  /**
+   * Last thing before the loop blocks: commit this iteration's changes. The
+   * requests we sent (or any reply we waited for in a handler) may have
+   * made Xlib read events into its queue, where the ev_io cannot see them;
+   * if so, the idle watcher keeps the loop from blocking and EIO_Check
+   * handles them straight after.
+   */
+  static void EIO_Prepare(EV_P_ struct ev_prepare* watcher, int revents) {
+    NodeWM* hw = static_cast<NodeWM*>(watcher->data);
+    HandleScope scope;
+    Commit(hw);
+    if(hw->be->queued() > 0 && !ev_is_active(&hw->idle)) {
+      ev_idle_start(EV_A_ &hw->idle);
+    }
+  }
+
+  static void EIO_Check(EV_P_ struct ev_check* watcher, int revents) {
+    NodeWM* hw = static_cast<NodeWM*>(watcher->data);
+    HandleScope scope;
+    if(ev_is_active(&hw->idle)) {
+      ev_idle_stop(EV_A_ &hw->idle);
+    }
+    if(hw->be->queued() > 0) {
+      HandleEvents(hw);
+    }
+  }
+
+  static void EIO_Idle(EV_P_ struct ev_idle* watcher, int revents) {
+  }
+
+  static int HandleEvents(NodeWM* hw) {
     XEvent event;
-    // main event loop 
-    XSync(hw->dpy, False);
-    while(XPending(hw->dpy)) {
-      XNextEvent(hw->dpy, &event);
-      fprintf(stderr, "got event %s (%d).\n", event_names[event.type], event.type);      
-      // handle event internally --> calls Node if necessary 
-      switch (event.type) {
-        case ButtonPress:
-          {
-            fprintf(stderr, "EmitButtonPress\n");
-            NodeWM::EmitButtonPress(hw, &event);
-          }
+    int handled = 0;
+    // main event loop; no XSync here, XPending flushes and reads for us
+    while(hw->be->pending()) {
+      hw->be->nextEvent(&event);
+      handled++;
+      if(hw->recorder && event.type == hw->rr_event) {
+        XRectangle heads[MAXHEADS];
+        int n = hw->be->queryScreens(heads, MAXHEADS);
+        trace_write_screens(hw->recorder, heads, n, ev_time());
+      } else if(hw->recorder) {
+        KeySym keysym = NoSymbol;
+        if(event.type == KeyPress || event.type == KeyRelease)
+          keysym = hw->be->keycodeToKeysym((KeyCode)event.xkey.keycode);
+        trace_write(hw->recorder, &event, keysym, ev_time());
+      }
+      HandleEvent(hw, &event);
+    }
+    return handled;
+  }
+
+  static void HandleEvent(NodeWM* hw, XEvent *event) {
+    debug("got event %s (%d).\n", (event->type < EVENT_NAMES ? event_names[event->type] : "extension"), event->type);
+    // handle event internally --> calls Node if necessary 
+    switch (event->type) {
+      case ButtonPress:
+        {
+          debug("EmitButtonPress\n");
+          NodeWM::EmitButtonPress(hw, event);
+        }
+        break;
+      case ConfigureRequest:
           break;
-        case ConfigureRequest:
-            break;
-        case ConfigureNotify:
-            break;
-        case DestroyNotify:
-            NodeWM::EmitDestroyNotify(hw, &event);        
-            break;
-        case EnterNotify:
-            NodeWM::EmitEnterNotify(hw, &event);
-            break;
-        case Expose:
-            break;
-        case FocusIn:
-         //   NodeWM::EmitFocusIn(hw, &event);
+      case ConfigureNotify:
+          break;
+      case DestroyNotify:
+          NodeWM::EmitDestroyNotify(hw, event);        
+          break;
+      case EnterNotify:
+          NodeWM::EmitEnterNotify(hw, event);
+          break;
+      case Expose:
+          NodeWM::EmitExpose(hw, event);
+          break;
+      case FocusIn:
+       //   NodeWM::EmitFocusIn(hw, event);
+          break;
+      case KeyPress:
+        {
+          debug("EmitKeyPress\n");
+          NodeWM::EmitKeyPress(hw, event);
+        }
+          break;
+      case MapNotify:
+          NodeWM::EmitMapNotify(hw, event);
+          break;
+      case MappingNotify:
+          break;
+      case MapRequest:
+        {
+          // read the window attrs, then add it to the managed windows...
+          XWindowAttributes wa;
+          XMapRequestEvent *ev = &event->xmaprequest;
+          if(!hw->be->getWindowAttributes(ev->window, &wa)) {
+            fprintf(stderr, "XGetWindowAttributes failed\n");              
             break;
-        case KeyPress:
-          {
-            fprintf(stderr, "EmitKeyPress\n");
-            NodeWM::EmitKeyPress(hw, &event);
           }
+          if(wa.override_redirect)
             break;
-        case MappingNotify:
-            break;
-        case MapRequest:
-          {
-            // read the window attrs, then add it to the managed windows...
-            XWindowAttributes wa;
-            XMapRequestEvent *ev = &event.xmaprequest;
-            if(!XGetWindowAttributes(hw->dpy, ev->window, &wa)) {
-              fprintf(stderr, "XGetWindowAttributes failed\n");              
-              return;
-            }
-            if(wa.override_redirect)
-              return;
-            fprintf(stderr, "MapRequest\n");
-            Client* c = NodeWM::getByWindow(hw, ev->window);
-            if(c == NULL) {
-              fprintf(stderr, "Emit manage!\n");
-              // dwm actually does this only once per window (e.g. for unknown windows only...)
-              // that's because otherwise you'll cause a hang when you map a mapped window again...
-              NodeWM::EmitAdd(hw, ev->window, &wa);
-            } else {
-              fprintf(stderr, "Window is known\n");              
-            }
+          debug("MapRequest\n");
+          Client* c = NodeWM::getByWindow(hw, ev->window);
+          if(c == NULL) {
+            debug("Emit manage!\n");
+            // dwm actually does this only once per window (e.g. for unknown windows only...)
+            // that's because otherwise you'll cause a hang when you map a mapped window again...
+            NodeWM::EmitAdd(hw, ev->window, &wa);
+          } else {
+            debug("Window is known\n");              
           }
-            break;
-        case PropertyNotify:
-            break;
-        case UnmapNotify:
-            NodeWM::EmitUnmapNotify(hw, &event);
-            break;
-        default:
-            break;
+        }
+          break;
+      case PropertyNotify:
+          NodeWM::EmitPropertyNotify(hw, event);
+          break;
+      case UnmapNotify:
+          NodeWM::EmitUnmapNotify(hw, event);
+          break;
+      default:
+          // screen changes are handled once, at Commit
+          if(event->type == hw->rr_event) {
+            hw->be->screenChanged(event);
+            hw->screen_dirty = True;
+          }
+          break;
+    }
+  }
+
+  // EVENT TRACES
+
+  /**
+   * record(path) writes every event received from now on to path,
+   * record() stops and returns the number of events written.
+   */
+  static Handle<Value> Record(const Arguments& args) {
+    HandleScope scope;
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    unsigned long count = 0;
+    if(hw->recorder) {
+      count = hw->recorder->count;
+      trace_close_writer(hw->recorder);
+      hw->recorder = NULL;
+    }
+    if(args[0]->IsString()) {
+      hw->recorder = trace_open_writer(*String::Utf8Value(args[0]), hw->root,
+                                       hw->screen_width, hw->screen_height, ev_time());
+      if(!hw->recorder) {
+        return ThrowException(Exception::Error(String::New("Could not open trace file for writing")));
+      }
+      return Undefined();
+    }
+    return scope.Close(Number::New(count));
+  }
+
+  /**
+   * replay(path) feeds a recorded trace through the event handlers as fast as
+   * possible and returns a report of events/sec and handler latencies.
+   * replay(path, { paced: true }, callback) keeps the original timing and
+   * calls back with the report at the end.
+   *
+   * Only against the fake server: the recorded window ids are mapped to fake
+   * windows, created the first time they are seen, and the replies the fake
+   * generates to our own requests are dropped since the trace has them. On a
+   * live display the ids would hit missing or unrelated windows.
+   */
+  static Handle<Value> Replay(const Arguments& args) {
+    HandleScope scope;
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    Bool paced = False;
+
+    if(!hw->fake) {
+      return ThrowException(Exception::Error(String::New("replay needs setup({ fake: ... })")));
+    }
+    if(hw->replay) {
+      return ThrowException(Exception::Error(String::New("A replay is already running")));
+    }
+    if(!(hw->replay = trace_open_reader(*String::Utf8Value(args[0])))) {
+      return ThrowException(Exception::Error(String::New("Could not read trace file")));
+    }
+    if(args[1]->IsObject()) {
+      paced = args[1]->ToObject()->Get(String::NewSymbol("paced"))->BooleanValue();
+    }
+    trace_map_free(&hw->replay_map);
+    trace_map_put(&hw->replay_map, hw->replay->header.root, hw->root);
+    memset(hw->latency, 0, sizeof(hw->latency));
+    hw->replay_count = 0;
+    hw->replay_start = ev_time();
+
+    if(!paced) {
+      while(trace_read(hw->replay, &hw->replay_rec, &hw->replay_ev)) {
+        ReplayEvent(hw, &hw->replay_rec, &hw->replay_ev);
+      }
+      Local<Object> report = makeReplayReport(hw, ev_time() - hw->replay_start);
+      trace_close_reader(hw->replay);
+      hw->replay = NULL;
+      return scope.Close(report);
+    }
+
+    if(args[2]->IsFunction()) {
+      hw->replay_cb = Persistent<Function>::New(Local<Function>::Cast(args[2]));
+    }
+    if(!trace_read(hw->replay, &hw->replay_rec, &hw->replay_ev)) {
+      FinishReplay(hw);
+      return Undefined();
+    }
+    ev_timer_init(&hw->replay_timer, EIO_ReplayTimer, hw->replay_rec.usec / 1e6, 0.);
+    hw->replay_timer.data = hw;
+    ev_timer_start(EV_DEFAULT_ &hw->replay_timer);
+    return Undefined();
+  }
+
+  static void EIO_ReplayTimer(EV_P_ struct ev_timer* watcher, int revents) {
+    NodeWM* hw = static_cast<NodeWM*>(watcher->data);
+    HandleScope scope;
+    ReplayEvent(hw, &hw->replay_rec, &hw->replay_ev);
+    if(!trace_read(hw->replay, &hw->replay_rec, &hw->replay_ev)) {
+      FinishReplay(hw);
+      return;
+    }
+    ev_timer_set(&hw->replay_timer, hw->replay_rec.usec / 1e6, 0.);
+    ev_timer_start(EV_A_ &hw->replay_timer);
+  }
+
+  static void FinishReplay(NodeWM* hw) {
+    HandleScope scope;
+    TryCatch try_catch;
+    Local<Value> argv[1];
+    argv[0] = makeReplayReport(hw, ev_time() - hw->replay_start);
+    trace_close_reader(hw->replay);
+    hw->replay = NULL;
+    if(!hw->replay_cb.IsEmpty()) {
+      Persistent<Function> callback = hw->replay_cb;
+      hw->replay_cb.Clear();
+      callback->Call(Context::GetCurrent()->Global(), 1, argv);
+      callback.Dispose();
+      if (try_catch.HasCaught()) {
+        FatalException(try_catch);
+      }
+    }
+  }
+
+  static Window ReplayWindow(void *data, Window win) {
+    NodeWM* hw = static_cast<NodeWM*>(data);
+    Window to = trace_map_get(&hw->replay_map, win);
+    if(to == None) {
+      to = hw->fake->simCreateWindow(0, 0, 640, 480, False, None);
+      trace_map_put(&hw->replay_map, win, to);
+    }
+    return to;
+  }
+
+  static void ReplayEvent(NodeWM* hw, TraceRecord *rec, XEvent *ev) {
+    double start;
+    if(rec->type == TRACE_SCREENS) {
+      // the fake takes the recorded heads and we get its RandR event
+      TraceScreens *ts = (TraceScreens *)ev;
+      if(hw->rr_event == -1)
+        return;
+      hw->fake->simSetScreens(ts->heads, (ts->count < TRACE_MAX_HEADS ? ts->count : TRACE_MAX_HEADS));
+      memset(ev, 0, sizeof(XEvent));
+      ev->type = hw->rr_event;
+      ev->xany.window = hw->root;
+    } else if(ev->type <= 0 || ev->type >= EVENT_NAMES) {
+      return;
+    } else {
+      if(rec->keysym != NoSymbol)
+        hw->fake->simSetKeysym((KeyCode)ev->xkey.keycode, rec->keysym);
+      trace_remap(ev, ReplayWindow, hw);
+    }
+    // recorded serials mean nothing here; the event is the user's doing
+    ev->xany.serial = hw->fake->stats.requests;
+    hw->fake->simDiscardEvents();
+    // each event gets a loop iteration of its own, commit included
+    start = ev_time();
+    HandleEvent(hw, ev);
+    Commit(hw);
+    double took = ev_time() - start;
+    if(ev->type < EVENT_NAMES) {
+      TraceLatency *l = &hw->latency[ev->type];
+      l->count++;
+      l->total += took;
+      if(took > l->max)
+        l->max = took;
+    }
+    hw->replay_count++;
+    hw->fake->simDiscardEvents();
+  }
+
+  static Local<Object> makeReplayReport(NodeWM* hw, double seconds) {
+    Local<Object> result = Object::New();
+    Local<Object> handlers = Object::New();
+    result->Set(String::NewSymbol("events"), Number::New(hw->replay_count));
+    result->Set(String::NewSymbol("seconds"), Number::New(seconds));
+    result->Set(String::NewSymbol("events_per_second"),
+                Number::New(seconds > 0 ? hw->replay_count / seconds : 0));
+    for(int i = 0; i < EVENT_NAMES; i++) {
+      TraceLatency *l = &hw->latency[i];
+      if(!l->count)
+        continue;
+      Local<Object> handler = Object::New();
+      handler->Set(String::NewSymbol("count"), Number::New(l->count));
+      handler->Set(String::NewSymbol("total_ms"), Number::New(l->total * 1e3));
+      handler->Set(String::NewSymbol("mean_us"), Number::New(l->total * 1e6 / l->count));
+      handler->Set(String::NewSymbol("max_us"), Number::New(l->max * 1e6));
+      handlers->Set(String::New(event_names[i]), handler);
+    }
+    result->Set(String::NewSymbol("handlers"), handlers);
+    return result;
+  }
+
+  // CONTROL SOCKET
+
+  static void EIO_ControlAccept(EV_P_ struct ev_io* watcher, int revents) {
+    NodeWM* hw = static_cast<NodeWM*>(watcher->data);
+    ControlClient *cl;
+    while((cl = control_accept(hw->control_fd))) {
+      ev_io_init(&cl->io, EIO_ControlClient, cl->fd, EV_READ);
+      cl->io.data = hw;
+      ev_io_start(EV_A_ &cl->io);
+      cl->next = hw->control_clients;
+      hw->control_clients = cl;
+    }
+  }
+
+  static void EIO_ControlClient(EV_P_ struct ev_io* watcher, int revents) {
+    NodeWM* hw = static_cast<NodeWM*>(watcher->data);
+    ControlClient *cl = (ControlClient *)watcher;
+    HandleScope scope;
+    Bool overflow;
+    char *line;
+    if(revents & EV_WRITE) {
+      if(!control_write(cl)) {
+        ControlClose(hw, cl);
+        return;
       }
+      if(!cl->outlen)
+        ControlWatch(cl, EV_READ);
+    }
+    if(!(revents & EV_READ))
+      return;
+    if(!control_read(cl)) {
+      ControlClose(hw, cl);
+      return;
+    }
+    // all the pipelined commands; replies are sent at Commit
+    while((line = control_line(cl, &overflow))) {
+      ControlCommand(hw, cl, line);
+    }
+    if(overflow) {
+      fprintf(stderr, "control: line too long, closing\n");
+      ControlClose(hw, cl);
+    }
+  }
+
+  static void ControlWatch(ControlClient *cl, int events) {
+    ev_io_stop(EV_DEFAULT_ &cl->io);
+    ev_io_set(&cl->io, cl->fd, events);
+    ev_io_start(EV_DEFAULT_ &cl->io);
+  }
+
+  static void ControlClose(NodeWM* hw, ControlClient *cl) {
+    ControlClient **tc;
+    for(tc = &hw->control_clients; *tc && *tc != cl; tc = &(*tc)->next);
+    *tc = cl->next;
+    ev_io_stop(EV_DEFAULT_ &cl->io);
+    control_free(cl);
+  }
+
+  /**
+   * One write per client per loop iteration. What the socket does not take
+   * is written when it becomes writable again.
+   */
+  static void ControlFlush(NodeWM* hw) {
+    ControlClient *cl, *next;
+    for(cl = hw->control_clients; cl; cl = next) {
+      next = cl->next;
+      if(cl->overflow) {
+        fprintf(stderr, "control: client is not reading its replies, closing\n");
+        ControlClose(hw, cl);
+        continue;
+      }
+      if(!cl->outlen || (cl->io.events & EV_WRITE))
+        continue;
+      if(!control_write(cl)) {
+        ControlClose(hw, cl);
+      } else if(cl->outlen) {
+        ControlWatch(cl, EV_READ | EV_WRITE);
+      }
+    }
+  }
+
+  static void ControlEvent(NodeWM* hw, unsigned int event, const char *name, int id) {
+    ControlClient *cl;
+    for(cl = hw->control_clients; cl; cl = cl->next)
+      if(cl->events & event)
+        control_printf(cl, "event %s %d\n", name, id);
+  }
+
+  /**
+   * Commands, one per line, each answered with "ok ..." or "error ...":
+   *
+   *   ping
+   *   focus <id>
+   *   move <id> <x> <y>
+   *   resize <id> <width> <height>
+   *   raise <id>
+   *   lower <id>
+   *   windows           ok <n>, then n lines: <id> <x> <y> <width> <height> <focused> <name>
+   *   subscribe <event>...   add, remove, focus; then "event <name> <id>" lines
+   *
+   * Anything else goes to the 'command' listener as (name, [args]); what it
+   * returns is appended to the "ok", and an exception becomes the error.
+   */
+  static void ControlCommand(NodeWM* hw, ControlClient *cl, char *line) {
+    char cmd[32];
+    int id, a, b, n;
+    Client *c;
+    if(sscanf(line, "%31s%n", cmd, &n) != 1) {
+      return;
+    }
+    if(!strcmp(cmd, "ping")) {
+      control_printf(cl, "ok\n");
+    } else if(!strcmp(cmd, "focus") || !strcmp(cmd, "raise") || !strcmp(cmd, "lower")) {
+      if(sscanf(line + n, "%d", &id) != 1 || !(c = getById(hw, id))) {
+        control_printf(cl, "error no such window\n");
+        return;
+      }
+      if(cmd[0] == 'f')
+        RealFocus(hw, id);
+      else if(cmd[0] == 'r')
+        StackRaise(hw, c);
+      else
+        StackLower(hw, c);
+      control_printf(cl, "ok\n");
+    } else if(!strcmp(cmd, "move") || !strcmp(cmd, "resize")) {
+      if(sscanf(line + n, "%d %d %d", &id, &a, &b) != 3 || !(c = getById(hw, id))) {
+        control_printf(cl, "error no such window\n");
+        return;
+      }
+      if(cmd[0] == 'm') {
+        c->x = a;
+        c->y = b;
+        markDirty(hw, c, DirtyPosition);
+      } else {
+        c->width = a;
+        c->height = b;
+        markDirty(hw, c, DirtySize);
+      }
+      control_printf(cl, "ok\n");
+    } else if(!strcmp(cmd, "windows")) {
+      Monitor *m;
+      n = 0;
+      for(m = hw->mons; m; m = m->next)
+        for(c = m->clients; c; c = c->next)
+          n++;
+      control_printf(cl, "ok %d\n", n);
+      for(m = hw->mons; m; m = m->next) {
+        for(c = m->clients; c; c = c->next) {
+          char name[BAR_TEXT];
+          strncpy(name, c->name, sizeof(name) - 1);
+          name[sizeof(name) - 1] = '\0';
+          control_printf(cl, "%d %d %d %d %d %d %s\n", c->id, c->x, c->y, c->width, c->height,
+                         (c == hw->monit->sel), control_oneline(name));
+        }
+      }
+    } else if(!strcmp(cmd, "subscribe")) {
+      char *name, *save;
+      for(name = strtok_r(line + n, " ", &save); name; name = strtok_r(NULL, " ", &save)) {
+        if(!strcmp(name, "add"))
+          cl->events |= ControlAdd;
+        else if(!strcmp(name, "remove"))
+          cl->events |= ControlRemove;
+        else if(!strcmp(name, "focus"))
+          cl->events |= ControlFocus;
+      }
+      control_printf(cl, "ok\n");
+    } else {
+      EmitCommand(hw, cl, cmd, line + n);
+    }
+  }
+
+  /**
+   * The listeners are called in order until one returns something or
+   * throws; that is the reply.
+   */
+  static void EmitCommand(NodeWM* hw, ControlClient *cl, const char *cmd, char *rest) {
+    TryCatch try_catch;
+    Local<Array> args = Array::New();
+    Local<Value> argv[2];
+    Local<Value> result;
+    Listener *l;
+    char *arg, *save;
+    int i = 0;
+    if(!hw->Wants(onCommand, NULL)) {
+      control_printf(cl, "error unknown command %s\n", cmd);
+      return;
+    }
+    for(arg = strtok_r(rest, " ", &save); arg; arg = strtok_r(NULL, " ", &save))
+      args->Set(i++, String::New(arg));
+    argv[0] = String::New(cmd);
+    argv[1] = args;
+    hw->emitting++;
+    for(l = hw->listeners[onCommand]; l; l = l->next) {
+      if(l->removed)
+        continue;
+      hw->emit_calls[onCommand]++;
+      result = l->callback->Call(Context::GetCurrent()->Global(), 2, argv);
+      if(try_catch.HasCaught() || !(result.IsEmpty() || result->IsUndefined() || result->IsNull()))
+        break;
+    }
+    if(--hw->emitting == 0 && hw->listeners_removed) {
+      SweepListeners(hw);
+    }
+    if(try_catch.HasCaught()) {
+      String::Utf8Value message(try_catch.Exception());
+      control_printf(cl, "error %s\n", control_oneline(*message));
+    } else if(result.IsEmpty() || result->IsUndefined() || result->IsNull()) {
+      control_printf(cl, "ok\n");
+    } else {
+      String::Utf8Value value(result);
+      control_printf(cl, "ok %s\n", control_oneline(*value));
+    }
+  }
+
+  // LAUNCHING
+
+  /**
+   * spawn(argv, { env, workspace }) starts a program and returns its pid.
+   * The program is looked up in PATH and gets our environment plus `env`
+   * (undefined or null values unset a variable). Its windows come with
+   * `workspace`, `pid` and `launch_ms` on the add event. posix_spawn does
+   * not copy the node process like fork does, and libev reaps the child.
+   */
+  static Handle<Value> Spawn(const Arguments& args) {
+    HandleScope scope;
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    posix_spawnattr_t attr;
+    sigset_t mask, defaults;
+    char **argv, **envp;
+    int i, argc, err;
+    Launch *l;
+
+    if(!args[0]->IsArray() || Local<Array>::Cast(args[0])->Length() == 0) {
+      return ThrowException(Exception::TypeError(String::New("spawn needs an argv array")));
+    }
+    Local<Array> list = Local<Array>::Cast(args[0]);
+    Local<Object> options = (args[1]->IsObject() ? args[1]->ToObject() : Object::New());
+    argc = list->Length();
+    argv = allocStrings(argc + 1);
+    for(i = 0; i < argc; i++) {
+      argv[i] = strdup(*String::Utf8Value(list->Get(i)));
+    }
+    if(!(l = (Launch *)calloc(1, sizeof(Launch)))) {
+      fprintf( stderr, "fatal: could not malloc() %lu bytes\n", sizeof(Launch));
+      exit( -1 );
+    }
+    snprintf(l->startup_id, sizeof(l->startup_id), "nwm-%d-%lu_TIME0", (int)getpid(), ++hw->launch_count);
+    envp = makeEnvironment(options->Get(String::NewSymbol("env")), l->startup_id);
+
+    // node blocks and ignores signals (SIGPIPE) that the program should get;
+    // its own session keeps it out of the terminal nwm was started from
+    sigemptyset(&mask);
+    ignoredSignals(&defaults);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    posix_spawnattr_setsigdefault(&attr, &defaults);
+#ifdef POSIX_SPAWN_SETSID
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSID);
+#else
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+#endif
+    err = posix_spawnp(&l->pid, argv[0], NULL, &attr, argv, envp);
+    posix_spawnattr_destroy(&attr);
+    if(err) {
+      fprintf(stderr, "spawn %s: %s\n", argv[0], strerror(err));
+    }
+    freeStrings(argv);
+    freeStrings(envp);
+    if(err) {
+      free(l);
+      return Undefined();
     }
-    return;
+
+    l->workspace = Persistent<Value>::New(options->Get(String::NewSymbol("workspace")));
+    l->started = ev_time();
+    // the child watcher alone does not keep node running
+    ev_child_init(&l->child, EIO_Child, l->pid, 0);
+    l->child.data = hw;
+    ev_child_start(EV_DEFAULT_ &l->child);
+    ev_unref(EV_DEFAULT_UC);
+    l->next = hw->launches;
+    hw->launches = l;
+    return scope.Close(Integer::New(l->pid));
+  }
+
+  /**
+   * The signals we ignore, which a program would inherit. Caught ones are
+   * reset by exec anyway, and asking for SIGKILL, SIGSTOP or libc's own
+   * signals makes some posix_spawn implementations fail in the child.
+   */
+  static void ignoredSignals(sigset_t *set) {
+    struct sigaction sa;
+    sigemptyset(set);
+    sigaddset(set, SIGPIPE);
+    for(int sig = 1; sig < NSIG; sig++) {
+      if(sig == SIGKILL || sig == SIGSTOP)
+        continue;
+      if(sigaction(sig, NULL, &sa) == 0 && sa.sa_handler == SIG_IGN)
+        sigaddset(set, sig);
+    }
+  }
+
+  static char** allocStrings(int n) {
+    char **list;
+    if(!(list = (char **)calloc(n, sizeof(char *)))) {
+      fprintf( stderr, "fatal: could not malloc() %lu bytes\n", n * sizeof(char *));
+      exit( -1 );
+    }
+    return list;
+  }
+
+  static void freeStrings(char **list) {
+    for(char **s = list; *s; s++)
+      free(*s);
+    free(list);
+  }
+
+  static char* envString(const char *name, const char *value) {
+    size_t size = strlen(name) + strlen(value) + 2;
+    char *str;
+    if(!(str = (char *)malloc(size))) {
+      fprintf( stderr, "fatal: could not malloc() %lu bytes\n", size);
+      exit( -1 );
+    }
+    snprintf(str, size, "%s=%s", name, value);
+    return str;
+  }
+
+  /**
+   * environ with the variables in `value` replaced, and DESKTOP_STARTUP_ID
+   */
+  static char** makeEnvironment(Local<Value> value, const char *startup_id) {
+    static const char startup_var[] = "DESKTOP_STARTUP_ID";
+    Local<Object> env;
+    Local<Array> names;
+    int i, n = 0, nnames = 0;
+    char **envp;
+
+    if(value->IsObject()) {
+      env = value->ToObject();
+      names = env->GetPropertyNames();
+      nnames = names->Length();
+    }
+    for(i = 0; environ[i]; i++);
+    envp = allocStrings(i + nnames + 2);
+    for(i = 0; environ[i]; i++) {
+      const char *eq = strchr(environ[i], '=');
+      int len = (eq ? eq - environ[i] : strlen(environ[i]));
+      if(len == (int)sizeof(startup_var) - 1 && !strncmp(environ[i], startup_var, len))
+        continue;
+      if(nnames && env->Has(String::New(environ[i], len)))
+        continue;
+      envp[n++] = strdup(environ[i]);
+    }
+    for(i = 0; i < nnames; i++) {
+      Local<Value> v = env->Get(names->Get(i));
+      if(v->IsUndefined() || v->IsNull())
+        continue;
+      envp[n++] = envString(*String::Utf8Value(names->Get(i)), *String::Utf8Value(v));
+    }
+    envp[n++] = envString(startup_var, startup_id);
+    return envp;
+  }
+
+  /**
+   * The window's _NET_STARTUP_ID, or else its _NET_WM_PID, against what we
+   * spawned. Also retires launches whose window never came.
+   */
+  static Launch* FindLaunch(NodeWM* hw, Window win) {
+    char id[sizeof(((Launch *)0)->startup_id)];
+    Launch *l = NULL, *next;
+    long pid;
+    double now = ev_time();
+
+    if(hw->be->getStartupId(win, id, sizeof(id))) {
+      for(l = hw->launches; l && strcmp(l->startup_id, id); l = l->next);
+    }
+    if(!l && (pid = hw->be->getWindowPid(win))) {
+      for(l = hw->launches; l && l->pid != pid; l = l->next);
+    }
+    for(Launch *t = hw->launches; t; t = next) {
+      next = t->next;
+      if(t != l && now - t->started > LAUNCH_TIMEOUT)
+        RetireLaunch(hw, t);
+    }
+    return l;
+  }
+
+  /**
+   * The launch's window was managed or never came: nothing else matches
+   * it from now on, and it stays only until libev reaps the program.
+   */
+  static void RetireLaunch(NodeWM* hw, Launch *l) {
+    Launch **tl;
+    if(l->exited) {
+      freeLaunch(hw, l);
+      return;
+    }
+    for(tl = &hw->launches; *tl && *tl != l; tl = &(*tl)->next);
+    *tl = l->next;
+    l->workspace.Dispose();
+    l->workspace.Clear();
+    l->retired = True;
+    l->next = hw->children;
+    hw->children = l;
+  }
+
+  static void freeLaunch(NodeWM* hw, Launch *l) {
+    Launch **tl;
+    for(tl = (l->retired ? &hw->children : &hw->launches); *tl && *tl != l; tl = &(*tl)->next);
+    *tl = l->next;
+    if(!l->exited) {
+      ev_ref(EV_DEFAULT_UC);
+      ev_child_stop(EV_DEFAULT_ &l->child);
+    }
+    l->workspace.Dispose();
+    free(l);
+  }
+
+  /**
+   * libev's SIGCHLD handler reaped a spawned program. A launch that is
+   * still pending stays until its window shows up or it times out.
+   */
+  static void EIO_Child(EV_P_ struct ev_child* watcher, int revents) {
+    NodeWM* hw = static_cast<NodeWM*>(watcher->data);
+    Launch *l = (Launch *)watcher;
+    ev_ref(EV_A);
+    ev_child_stop(EV_A_ watcher);
+    l->exited = True;
+    if(WIFSIGNALED(watcher->rstatus)) {
+      fprintf(stderr, "spawn: pid %d killed by signal %d\n", watcher->rpid, WTERMSIG(watcher->rstatus));
+    }
+    if(l->retired) {
+      freeLaunch(hw, l);
+    }
+  }
+
+  // SIMULATION
+
+  static Handle<Value> SimCreateWindow(const Arguments& args) {
+    HandleScope scope;
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    if(!hw->fake) {
+      return Undefined();
+    }
+    Window win = hw->fake->simCreateWindow(args[0]->IntegerValue(), args[1]->IntegerValue(),
+                                           args[2]->IntegerValue(), args[3]->IntegerValue(),
+                                           args[4]->BooleanValue(), args[5]->IntegerValue());
+    return scope.Close(Integer::New(win));
+  }
+
+  static Handle<Value> SimMapWindow(const Arguments& args) {
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    if(hw->fake) {
+      hw->fake->simMapWindow(args[0]->IntegerValue());
+    }
+    return Undefined();
+  }
+
+  static Handle<Value> SimDestroyWindow(const Arguments& args) {
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    if(hw->fake) {
+      hw->fake->simDestroyWindow(args[0]->IntegerValue());
+    }
+    return Undefined();
+  }
+
+  static Handle<Value> SimEnterWindow(const Arguments& args) {
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    if(hw->fake) {
+      hw->fake->simEnterWindow(args[0]->IntegerValue());
+    }
+    return Undefined();
+  }
+
+  static Handle<Value> SimButtonPress(const Arguments& args) {
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    if(hw->fake) {
+      hw->fake->simButtonPress(args[0]->IntegerValue(), args[1]->IntegerValue(), args[2]->IntegerValue());
+    }
+    return Undefined();
+  }
+
+  static Handle<Value> SimKeyPress(const Arguments& args) {
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    if(hw->fake) {
+      hw->fake->simKeyPress(args[0]->IntegerValue(), args[1]->IntegerValue());
+    }
+    return Undefined();
+  }
+
+  /**
+   * simSetPid(window, pid, [startup_id]) sets _NET_WM_PID and _NET_STARTUP_ID
+   */
+  static Handle<Value> SimSetPid(const Arguments& args) {
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    if(hw->fake) {
+      hw->fake->simSetPid(args[0]->IntegerValue(), args[1]->IntegerValue(),
+                          (args[2]->IsString() ? *String::Utf8Value(args[2]) : NULL));
+    }
+    return Undefined();
+  }
+
+  static Handle<Value> SimSetName(const Arguments& args) {
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    if(hw->fake) {
+      hw->fake->simSetName(args[0]->IntegerValue(), *String::Utf8Value(args[1]));
+    }
+    return Undefined();
+  }
+
+  /**
+   * simSetScreens([{ x, y, width, height }, ...]) replaces the monitors
+   */
+  static Handle<Value> SimSetScreens(const Arguments& args) {
+    HandleScope scope;
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    XRectangle heads[MAXHEADS];
+    int i, n;
+    if(!hw->fake || !args[0]->IsArray()) {
+      return Undefined();
+    }
+    Local<Array> list = Local<Array>::Cast(args[0]);
+    n = (list->Length() < MAXHEADS ? list->Length() : MAXHEADS);
+    for(i = 0; i < n; i++) {
+      Local<Object> head = list->Get(i)->ToObject();
+      heads[i].x = head->Get(String::NewSymbol("x"))->IntegerValue();
+      heads[i].y = head->Get(String::NewSymbol("y"))->IntegerValue();
+      heads[i].width = head->Get(String::NewSymbol("width"))->IntegerValue();
+      heads[i].height = head->Get(String::NewSymbol("height"))->IntegerValue();
+    }
+    hw->fake->simSetScreens(heads, n);
+    return Undefined();
+  }
+
+  /**
+   * X traffic generated so far; { requests, roundtrips, flushes, events, pixels }
+   */
+  static Handle<Value> SimStats(const Arguments& args) {
+    HandleScope scope;
+    NodeWM* hw = ObjectWrap::Unwrap<NodeWM>(args.This());
+    if(!hw->fake) {
+      return Undefined();
+    }
+    Local<Object> result = Object::New();
+    result->Set(String::NewSymbol("requests"), Number::New(hw->fake->stats.requests));
+    result->Set(String::NewSymbol("roundtrips"), Number::New(hw->fake->stats.roundtrips));
+    result->Set(String::NewSymbol("flushes"), Number::New(hw->fake->stats.flushes));
+    result->Set(String::NewSymbol("events"), Number::New(hw->fake->stats.events));
+    result->Set(String::NewSymbol("pixels"), Number::New(hw->fake->stats.pixels));
+    return scope.Close(result);
   }
 
   static int xerror(Display *dpy, XErrorEvent *ee) {
@@ -889,6 +2851,9 @@ public:
   }
 */
   ev_io watcher;
+  ev_prepare prepare;
+  ev_check check;
+  ev_idle idle;
 };
 
 Persistent<FunctionTemplate> NodeWM::s_ct;
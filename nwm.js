@@ -1,7 +1,5 @@
 var repl = require('repl');
 var X11wm = require('./build/default/nwm.node').NodeWM;
-var child_process = require('child_process');
-var XK = require('./keysymdef.js');
 var Xh = require('./x.js');
 
 var NWM = function() {
@@ -16,6 +14,10 @@ NWM.prototype.start = function() {
   this.wm = new X11wm();
   var self = this;  
   this.workspace = 1;
+  // keysyms come from the native table, keysymdef.js is not loaded
+  function XK(name) {
+    return self.wm.keysymFromName('XK_' + name);
+  }
 
   /**
    * A single window should be positioned
@@ -23,7 +25,10 @@ NWM.prototype.start = function() {
   this.wm.on('add', function(window) {
     if(window.id) {
       window.visible = true;
-      window.workspace = self.workspace;
+      // windows of a program started with spawn() come with its workspace
+      if(window.workspace === undefined) {
+        window.workspace = self.workspace;
+      }
       self.windows[window.id] = window;      
       // windows might be placed outside the screen if the wm was terminated
        console.log(window);
@@ -31,6 +36,11 @@ NWM.prototype.start = function() {
         console.log('Moving window '+window.id+' on to screen');
         self.move(window.id, 1, 1);
       }
+      // not mapped yet: it appears hidden, and the rearrange leaves it be
+      if(window.workspace != self.workspace) {
+        window.visible = false;
+        self.wm.moveWindow(window.id, window.x + 2*self.screen.width, window.y);
+      }
       console.log('onAdd', self.windows[window.id]);
     }
   });
@@ -45,12 +55,29 @@ NWM.prototype.start = function() {
 
   this.wm.on('rearrange', function() { self.rearrange(); }); 
 
+  /**
+   * Monitors were added, removed or resized
+   */
+  this.wm.on('screenChange', function(screen) {
+    console.log('screenChange', screen);
+    self.screen = screen;
+    screen.moved.forEach(function(id) {
+      if(self.windows[id]) {
+        self.windows[id].monitor = screen.monitors[0].id;
+      }
+    });
+    if(screen.monitors.some(function(monitor) { return monitor.changed; })) {
+      self.rearrange();
+    }
+  });
+
   /**
    * A mouse button has been clicked
    */
   this.wm.on('buttonPress', function(event) {
     console.log('Button pressed', event);
     self.wm.focusWindow(event.id);
+    self.wm.raise(event.id);
   });
 
   this.wm.on('enterNotify',function(event){
@@ -70,59 +97,82 @@ NWM.prototype.start = function() {
   this.wm.on('keyPress', function(key) {
     // do something, e.g. launch a command
     var chr = String.fromCharCode(key.keysym);
-    var keysym_name = '';
-    Object.keys(X11keysym).every(function(name) {
-      if(X11keysym[name] == key.keysym) {
-        keysym_name = name;
-        return false; // stop iteration
-      }
-      return true;
-    });
-    console.log('keyPress', key, chr, keysym_name);
-    if( key.keysym > XK.XK_KP_0 && key.keysym < XK.XK_KP_9) {
+    console.log('keyPress', key, chr, key.name);
+    if( key.keysym > XK('KP_0') && key.keysym < XK('KP_9')) {
       self.go(chr); // jump to workspace
     }
-    if(key.keysym == XK.XK_Return) {
-      // enter pressed ...
-      console.log('Enter key, start xterm');
-      child_process.spawn('xterm', ['-lc'], { env: { 'DISPLAY': ':1' } });
-    }
     return key;
   });  
+
+  // filtered natively, the listener only sees Return
+  this.wm.on('keyPress', function(key) {
+    console.log('Enter key, start xterm');
+    self.spawn(['xterm', '-lc']);
+  }, { keysym: 'XK_Return' });
+  /**
+   * A control socket command that nwm does not handle itself,
+   * e.g. `echo workspace 2 | socat - UNIX-CONNECT:$XDG_RUNTIME_DIR/nwm-$(id -u).sock`
+   */
+  this.wm.on('command', function(name, args) {
+    if(name == 'workspace') {
+      if(args.length > 0) {
+        self.go(args[0]);
+      }
+      return self.workspace;
+    }
+    throw 'unknown command ' + name;
+  });
+
   this.screen = this.wm.setup({
+    bar: { font: 'fixed' },
+    control: process.env.NWM_CONTROL
+      || (process.env.XDG_RUNTIME_DIR || '/tmp') + '/nwm-' + process.getuid() + '.sock',
     keys: [ 
-      { key: XK.XK_1, modifier: Xh.Mod4Mask|Xh.ControlMask },
-      { key: XK.XK_2, modifier: Xh.Mod4Mask|Xh.ControlMask },
-      { key: XK.XK_3, modifier: Xh.Mod4Mask|Xh.ControlMask },
-      { key: XK.XK_4, modifier: Xh.Mod4Mask|Xh.ControlMask },
-      { key: XK.XK_5, modifier: Xh.Mod4Mask|Xh.ControlMask },
-      { key: XK.XK_6, modifier: Xh.Mod4Mask|Xh.ControlMask },
-      { key: XK.XK_7, modifier: Xh.Mod4Mask|Xh.ControlMask },
-      { key: XK.XK_8, modifier: Xh.Mod4Mask|Xh.ControlMask },
-      { key: XK.XK_9, modifier: Xh.Mod4Mask|Xh.ControlMask },
-      { key: XK.XK_0, modifier: Xh.Mod4Mask|Xh.ControlMask },
-
-      { key: XK.XK_1, modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
-      { key: XK.XK_2, modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
-      { key: XK.XK_3, modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
-      { key: XK.XK_4, modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
-      { key: XK.XK_5, modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
-      { key: XK.XK_6, modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
-      { key: XK.XK_7, modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
-      { key: XK.XK_8, modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
-      { key: XK.XK_9, modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
-      { key: XK.XK_0, modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
-
-      { key: XK.XK_Return, modifier: Xh.Mod4Mask|Xh.ControlMask }
+      { key: XK('1'), modifier: Xh.Mod4Mask|Xh.ControlMask },
+      { key: XK('2'), modifier: Xh.Mod4Mask|Xh.ControlMask },
+      { key: XK('3'), modifier: Xh.Mod4Mask|Xh.ControlMask },
+      { key: XK('4'), modifier: Xh.Mod4Mask|Xh.ControlMask },
+      { key: XK('5'), modifier: Xh.Mod4Mask|Xh.ControlMask },
+      { key: XK('6'), modifier: Xh.Mod4Mask|Xh.ControlMask },
+      { key: XK('7'), modifier: Xh.Mod4Mask|Xh.ControlMask },
+      { key: XK('8'), modifier: Xh.Mod4Mask|Xh.ControlMask },
+      { key: XK('9'), modifier: Xh.Mod4Mask|Xh.ControlMask },
+      { key: XK('0'), modifier: Xh.Mod4Mask|Xh.ControlMask },
+
+      { key: XK('1'), modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
+      { key: XK('2'), modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
+      { key: XK('3'), modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
+      { key: XK('4'), modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
+      { key: XK('5'), modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
+      { key: XK('6'), modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
+      { key: XK('7'), modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
+      { key: XK('8'), modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
+      { key: XK('9'), modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
+      { key: XK('0'), modifier: Xh.Mod4Mask|Xh.ControlMask|Xh.ShiftMask },
+
+      { key: XK('Return'), modifier: Xh.Mod4Mask|Xh.ControlMask }
 
     ]
   });
+  // NWM_TRACE=file records every X event for bench/replay.js
+  if(process.env.NWM_TRACE) {
+    this.wm.record(process.env.NWM_TRACE);
+  }
+  this.wm.setWorkspaces(this.workspaceText());
   this.wm.scan();
   this.wm.loop();
 
   repl.start().context.nwm = self;
 };
 
+/**
+ * Start a program with our environment; its windows go to `workspace`,
+ * the current one by default
+ */
+NWM.prototype.spawn = function(argv, workspace) {
+  return this.wm.spawn(argv, { workspace: (workspace === undefined ? this.workspace : workspace) });
+};
+
 NWM.prototype.hide = function(id) {
   var screen = this.screen;
   if(this.windows[id] && this.windows[id].visible) {
@@ -177,10 +227,19 @@ NWM.prototype.go = function(workspace) {
   });
   if(workspace != this.workspace) {
     this.workspace = workspace;
+    this.wm.setWorkspaces(this.workspaceText());
     this.rearrange();
   }
 };
 
+NWM.prototype.workspaceText = function() {
+  var text = [];
+  for(var i = 1; i <= 9; i++) {
+    text.push(i == this.workspace ? '[' + i + ']' : ' ' + i + ' ');
+  }
+  return text.join('');
+};
+
 NWM.prototype.gimme = function(id){
   this.windowTo(id, this.workspace);
 }
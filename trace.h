@@ -0,0 +1,318 @@
+/* This code is PUBLIC DOMAIN, and is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND. See the accompanying
+ * LICENSE file.
+ */
+
+#ifndef NWM_TRACE_H
+#define NWM_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <X11/Xlib.h>
+
+/**
+ * Event traces.
+ *
+ * A trace file is a TraceHeader followed by one TraceRecord per event, each
+ * followed by the first `size` bytes of the XEvent. Only the struct that
+ * matches the event type is stored (an XKeyEvent is about half an XEvent) and
+ * the display pointer is cleared, so traces are compact and can be replayed
+ * in another process.
+ */
+
+#define TRACE_MAGIC "NWMTRACE"
+// 2: 64-bit time deltas, screen change records
+#define TRACE_VERSION 2
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t root;       // root window id when recorded
+  uint32_t width;      // screen size when recorded
+  uint32_t height;
+} TraceHeader;
+
+typedef struct {
+  uint64_t usec;       // time since the previous record
+  uint16_t size;       // bytes of XEvent that follow
+  uint16_t type;
+  uint32_t keysym;     // key events: keysym at record time, keycodes do not travel
+} TraceRecord;
+
+static size_t trace_event_size(int type) {
+  switch(type) {
+    case KeyPress:
+    case KeyRelease: return sizeof(XKeyEvent);
+    case ButtonPress:
+    case ButtonRelease: return sizeof(XButtonEvent);
+    case MotionNotify: return sizeof(XMotionEvent);
+    case EnterNotify:
+    case LeaveNotify: return sizeof(XCrossingEvent);
+    case FocusIn:
+    case FocusOut: return sizeof(XFocusChangeEvent);
+    case Expose: return sizeof(XExposeEvent);
+    case CreateNotify: return sizeof(XCreateWindowEvent);
+    case DestroyNotify: return sizeof(XDestroyWindowEvent);
+    case UnmapNotify: return sizeof(XUnmapEvent);
+    case MapNotify: return sizeof(XMapEvent);
+    case MapRequest: return sizeof(XMapRequestEvent);
+    case ConfigureNotify: return sizeof(XConfigureEvent);
+    case ConfigureRequest: return sizeof(XConfigureRequestEvent);
+    case PropertyNotify: return sizeof(XPropertyEvent);
+    case ClientMessage: return sizeof(XClientMessageEvent);
+    case MappingNotify: return sizeof(XMappingEvent);
+    default: return sizeof(XEvent);
+  }
+}
+
+typedef struct {
+  FILE *file;
+  double last;
+  unsigned long count;
+} TraceWriter;
+
+/**
+ * Returns NULL if path cannot be written.
+ */
+static TraceWriter* trace_open_writer(const char *path, Window root, int width, int height, double now) {
+  TraceWriter *tw;
+  TraceHeader th;
+  FILE *file;
+  if(!(file = fopen(path, "wb")))
+    return NULL;
+  memset(&th, 0, sizeof(th));
+  memcpy(th.magic, TRACE_MAGIC, sizeof(th.magic));
+  th.version = TRACE_VERSION;
+  th.root = root;
+  th.width = width;
+  th.height = height;
+  if(fwrite(&th, sizeof(th), 1, file) != 1) {
+    fclose(file);
+    return NULL;
+  }
+  if(!(tw = (TraceWriter *)calloc(1, sizeof(TraceWriter)))) {
+    fprintf( stderr, "fatal: could not malloc() %lu bytes\n", sizeof(TraceWriter));
+    exit( -1 );
+  }
+  tw->file = file;
+  tw->last = now;
+  return tw;
+}
+
+static void trace_write(TraceWriter *tw, XEvent *ev, KeySym keysym, double now) {
+  TraceRecord tr;
+  XEvent copy = *ev;
+  copy.xany.display = NULL;
+  tr.usec = (uint64_t)((now - tw->last) * 1e6);
+  tr.size = trace_event_size(ev->type);
+  tr.type = ev->type;
+  tr.keysym = keysym;
+  tw->last = now;
+  // stdio buffers the writes, the file is only touched every few KB
+  fwrite(&tr, sizeof(tr), 1, tw->file);
+  fwrite(&copy, tr.size, 1, tw->file);
+  tw->count++;
+}
+
+/**
+ * A screen change is stored as the monitor layout after it, in a record of
+ * type TRACE_SCREENS: the RandR event type differs per server, and the
+ * event does not say where the heads are. Small enough for an XEvent.
+ */
+#define TRACE_SCREENS 0xffff
+#define TRACE_MAX_HEADS 8
+
+typedef struct {
+  uint32_t count;
+  XRectangle heads[TRACE_MAX_HEADS];
+} TraceScreens;
+
+static void trace_write_screens(TraceWriter *tw, XRectangle *heads, int n, double now) {
+  TraceRecord tr;
+  TraceScreens ts;
+  memset(&ts, 0, sizeof(ts));
+  ts.count = (n < TRACE_MAX_HEADS ? n : TRACE_MAX_HEADS);
+  memcpy(ts.heads, heads, ts.count * sizeof(XRectangle));
+  tr.usec = (uint64_t)((now - tw->last) * 1e6);
+  tr.size = sizeof(ts);
+  tr.type = TRACE_SCREENS;
+  tr.keysym = NoSymbol;
+  tw->last = now;
+  fwrite(&tr, sizeof(tr), 1, tw->file);
+  fwrite(&ts, tr.size, 1, tw->file);
+  tw->count++;
+}
+
+static void trace_close_writer(TraceWriter *tw) {
+  fclose(tw->file);
+  free(tw);
+}
+
+typedef struct {
+  FILE *file;
+  TraceHeader header;
+} TraceReader;
+
+/**
+ * Returns NULL if path cannot be read or is not a trace.
+ */
+static TraceReader* trace_open_reader(const char *path) {
+  TraceReader *tr;
+  FILE *file;
+  if(!(file = fopen(path, "rb")))
+    return NULL;
+  if(!(tr = (TraceReader *)calloc(1, sizeof(TraceReader)))) {
+    fprintf( stderr, "fatal: could not malloc() %lu bytes\n", sizeof(TraceReader));
+    exit( -1 );
+  }
+  tr->file = file;
+  if(fread(&tr->header, sizeof(TraceHeader), 1, file) != 1
+  || memcmp(tr->header.magic, TRACE_MAGIC, sizeof(tr->header.magic)) != 0
+  || tr->header.version != TRACE_VERSION) {
+    fclose(file);
+    free(tr);
+    return NULL;
+  }
+  return tr;
+}
+
+/**
+ * Read the next event. Returns False at the end of the trace.
+ */
+static Bool trace_read(TraceReader *tr, TraceRecord *rec, XEvent *ev) {
+  if(fread(rec, sizeof(TraceRecord), 1, tr->file) != 1
+  || rec->size > sizeof(XEvent))
+    return False;
+  memset(ev, 0, sizeof(XEvent));
+  return fread(ev, rec->size, 1, tr->file) == 1;
+}
+
+static void trace_close_reader(TraceReader *tr) {
+  fclose(tr->file);
+  free(tr);
+}
+
+/**
+ * Window ids in a trace belong to the server it was recorded on. When
+ * replaying against another server every window field is passed through
+ * fn, which returns the id to use instead.
+ */
+typedef Window (*TraceRemapFn)(void *data, Window win);
+
+static void trace_remap(XEvent *ev, TraceRemapFn fn, void *data) {
+#define REMAP(field) if(field != None) field = fn(data, field)
+  REMAP(ev->xany.window);
+  switch(ev->type) {
+    case KeyPress:
+    case KeyRelease:
+      REMAP(ev->xkey.root);
+      REMAP(ev->xkey.subwindow);
+      break;
+    case ButtonPress:
+    case ButtonRelease:
+      REMAP(ev->xbutton.root);
+      REMAP(ev->xbutton.subwindow);
+      break;
+    case MotionNotify:
+      REMAP(ev->xmotion.root);
+      REMAP(ev->xmotion.subwindow);
+      break;
+    case EnterNotify:
+    case LeaveNotify:
+      REMAP(ev->xcrossing.root);
+      REMAP(ev->xcrossing.subwindow);
+      break;
+    case CreateNotify:
+      REMAP(ev->xcreatewindow.window);
+      break;
+    case DestroyNotify:
+      REMAP(ev->xdestroywindow.window);
+      break;
+    case UnmapNotify:
+      REMAP(ev->xunmap.window);
+      break;
+    case MapNotify:
+      REMAP(ev->xmap.window);
+      break;
+    case MapRequest:
+      REMAP(ev->xmaprequest.window);
+      break;
+    case ConfigureNotify:
+      REMAP(ev->xconfigure.window);
+      REMAP(ev->xconfigure.above);
+      break;
+    case ConfigureRequest:
+      REMAP(ev->xconfigurerequest.window);
+      REMAP(ev->xconfigurerequest.above);
+      break;
+  }
+#undef REMAP
+}
+
+/**
+ * Open addressing hash from recorded to replayed window ids.
+ */
+typedef struct {
+  Window from;
+  Window to;
+} TraceMapping;
+
+typedef struct {
+  TraceMapping *slots;
+  unsigned int size;
+  unsigned int used;
+} TraceWindowMap;
+
+static TraceMapping* trace_map_slot(TraceMapping *slots, unsigned int size, Window from) {
+  unsigned int i = (unsigned int)(from * 2654435761u) & (size - 1);
+  while(slots[i].from != None && slots[i].from != from)
+    i = (i + 1) & (size - 1);
+  return &slots[i];
+}
+
+static Window trace_map_get(TraceWindowMap *map, Window from) {
+  if(!map->size)
+    return None;
+  return trace_map_slot(map->slots, map->size, from)->to;
+}
+
+static void trace_map_put(TraceWindowMap *map, Window from, Window to) {
+  TraceMapping *slot;
+  if((map->used + 1) * 2 > map->size) {
+    unsigned int i, size = (map->size ? map->size * 2 : 256);
+    TraceMapping *slots;
+    if(!(slots = (TraceMapping *)calloc(size, sizeof(TraceMapping)))) {
+      fprintf( stderr, "fatal: could not malloc() %lu bytes\n", size * sizeof(TraceMapping));
+      exit( -1 );
+    }
+    for(i = 0; i < map->size; i++)
+      if(map->slots[i].from != None)
+        *trace_map_slot(slots, size, map->slots[i].from) = map->slots[i];
+    free(map->slots);
+    map->slots = slots;
+    map->size = size;
+  }
+  slot = trace_map_slot(map->slots, map->size, from);
+  if(slot->from == None)
+    map->used++;
+  slot->from = from;
+  slot->to = to;
+}
+
+static void trace_map_free(TraceWindowMap *map) {
+  free(map->slots);
+  memset(map, 0, sizeof(TraceWindowMap));
+}
+
+/**
+ * Per event type handler latency, filled in while replaying.
+ */
+typedef struct {
+  unsigned long count;
+  double total;
+  double max;
+} TraceLatency;
+
+#endif